@@ -0,0 +1,66 @@
+//
+//  dictionary_benchmark.cpp
+//
+//  Copyright 2020 Marco Oliva. All rights reserved.
+//
+
+#include <random>
+#include <chrono>
+
+#include <CLI/CLI.hpp>
+#include <version.hpp>
+#include <utils.hpp>
+#include <pfp_algo.hpp>
+
+int main(int argc, char **argv)
+{
+    CLI::App app("Dictionary contention benchmark");
+
+    std::size_t max_threads = 64;
+    std::size_t phrases_per_thread = 2000000;
+    std::size_t distinct_phrases = 500000;
+    std::size_t phrase_length = 100;
+
+    app.add_option("-t,--max-threads", max_threads, "Maximum number of threads, doubled from 1")->check(CLI::Range(1, 1024));
+    app.add_option("-n,--phrases", phrases_per_thread, "Phrases inserted by each thread");
+    app.add_option("-u,--distinct", distinct_phrases, "Number of distinct phrases")->check(CLI::Range(1, 1 << 30));
+    app.add_option("-l,--length", phrase_length, "Phrase length")->check(CLI::Range(1, 1 << 20));
+    app.add_flag_callback("--version",vcfbwt::Version::print,"Version");
+    app.allow_windows_style_options();
+
+    CLI11_PARSE(app, argc, argv);
+
+    // Print out configurations
+    spdlog::info("Current Configuration:\n{}", app.config_to_str(true,true));
+
+    // Random phrases, most of the insertions are repeats like in a real parse
+    spdlog::info("Generating phrases");
+    std::mt19937_64 generator(42);
+    std::uniform_int_distribution<int> nucleotide(0, 3);
+    const char nucleotides[4] = { 'A', 'C', 'G', 'T' };
+    std::vector<std::string> phrases(distinct_phrases);
+    for (auto& phrase : phrases)
+    {
+        phrase.resize(phrase_length);
+        for (auto& c : phrase) { c = nucleotides[nucleotide(generator)]; }
+    }
+
+    for (std::size_t threads = 1; threads <= max_threads; threads *= 2)
+    {
+        vcfbwt::pfp::Dictionary dictionary;
+
+        auto start = std::chrono::steady_clock::now();
+        #pragma omp parallel for schedule(static) num_threads(threads)
+        for (std::size_t t = 0; t < threads; t++)
+        {
+            std::mt19937_64 thread_generator(t);
+            std::uniform_int_distribution<std::size_t> pick(0, distinct_phrases - 1);
+            for (std::size_t i = 0; i < phrases_per_thread; i++) { dictionary.check_and_add(phrases[pick(thread_generator)]); }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        double throughput = (threads * phrases_per_thread) / elapsed.count();
+        spdlog::info("Threads: {}\tDictionary size: {}\tTime: {:.3f}s\tThroughput: {:.2f} M phrases/s",
+                     threads, dictionary.size(), elapsed.count(), throughput / 1000000.0);
+    }
+}
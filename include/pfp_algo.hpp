@@ -8,8 +8,15 @@
 #define pfp_algo_hpp
 
 #include <vector>
+#include <bit>
+#include <utility>
+#include <atomic>
 #include <unordered_map>
 #include <set>
+#include <map>
+#include <deque>
+#include <tuple>
+#include <limits>
 #include <iostream>
 #include <fstream>
 #include <vcf.hpp>
@@ -32,6 +39,11 @@ enum SPECIAL_TYPES
     DOLLAR_PRIME = 5
 };
 
+// Size of the blocks of input scanned at once for trigger strings
+constexpr std::size_t PARSING_BLOCK_SIZE = MEGABYTE;
+constexpr std::size_t CLOSING_CHUNK_SIZE = MEGABYTE; // parse elements per chunk when closing in parallel
+constexpr std::size_t FASTA_IN_FLIGHT_BYTES = GIGABYTE; // fasta records read but not yet in the parse
+
 //------------------------------------------------------------------------------
 
 class Dictionary
@@ -40,36 +52,74 @@ public:
 
     vcfbwt::size_type insertions_safe_guard = 1000;
 
-    std::mutex dictionary_mutex;
+    std::mutex dictionary_mutex; // guards the sorted phrases
 
-    bool sorted = false;
+    std::atomic<bool> sorted = false;
     
+    // Phrases live in the shard arena, an entry is just where to find them
     struct DictionaryEntry
     {
-        std::string phrase;
+        Arena::Position position;
+        std::size_t length = 0; // 0 marks an empty slot
+        size_type id = 0; // dense, in insertion order
+    };
+    
+    // Open addressing table with linear probing, sharded on the top bits of the phrase hash. Each shard has its own
+    // lock so parsers working on different phrases don't contend.
+    static constexpr std::size_t shards_bits = 6;
     
-        DictionaryEntry() = default;
-        DictionaryEntry(const std::string& s) : phrase(s) {}
+    struct alignas(64) Shard
+    {
+        using slot_type = std::pair<hash_type, DictionaryEntry>;
+        
+        std::mutex mutex;
+        std::vector<slot_type> slots;
+        std::size_t entries = 0;
+        Arena arena;
+        
+        const DictionaryEntry* find(hash_type hash) const;
+        DictionaryEntry* find(hash_type hash) { return const_cast<DictionaryEntry*>(std::as_const(*this).find(hash)); }
+        const DictionaryEntry& insert(hash_type hash, std::string_view phrase, size_type id);
+        std::string_view phrase(const DictionaryEntry& entry) const { return arena.view(entry.position, entry.length); }
     };
     
-    std::unordered_map<hash_type, DictionaryEntry> hash_string_map;
-    std::vector<std::pair<std::reference_wrapper<std::string>, hash_type>> sorted_phrases;
-    std::unordered_map<hash_type, size_type> hash_to_ranks;
+    std::array<Shard, std::size_t(1) << shards_bits> shards;
+    std::atomic<std::size_t> entries_number = 0;
+    
+    Shard& shard_of(hash_type hash) { return shards[hash >> ((8 * sizeof(hash_type)) - shards_bits)]; }
+    
+    std::vector<std::pair<std::string_view, hash_type>> sorted_phrases; // views on the shard arenas
+    std::vector<size_type> ranks; // phrase id to 1 based rank, set by sort()
     
     void sort();
     
     Dictionary() = default;
     
-    hash_type add(const std::string& phrase);
-    hash_type check_and_add(const std::string& phrase);
-    hash_type get(const std::string& phrase) const;
-    bool contains(const std::string& phrase);
+    // Phrases are copied only when added to the dictionary
+    hash_type add(std::string_view phrase);
+    hash_type check_and_add(std::string_view phrase);
+    size_type check_and_add_id(std::string_view phrase);
+    std::pair<size_type, std::string_view> find_or_add(hash_type phrase_hash, std::string_view phrase); // id and stored phrase
+    hash_type get(std::string_view phrase) const;
+    bool contains(std::string_view phrase);
 
     size_type hash_to_rank(hash_type hash);
+    size_type id_to_rank(size_type id) { if (not this->sorted) { sort(); } return ranks[id]; }
+    
+    size_type size() const { return entries_number.load(std::memory_order_relaxed); }
     
-    size_type size() const { return hash_string_map.size(); }
+    // Calls f(hash, phrase) on every entry
+    template <typename Function>
+    void for_each(Function&& f)
+    {
+        for (auto& shard : shards)
+        {
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            for (auto& slot : shard.slots) { if (slot.second.length != 0) { f(slot.first, shard.phrase(slot.second)); } }
+        }
+    }
     
-    const std::string& sorted_entry_at(std::size_t i);
+    std::string_view sorted_entry_at(std::size_t i);
     
     static void merge(Dictionary& destination, const Dictionary& source);
     
@@ -88,6 +138,8 @@ struct Params
     bool compute_occurrences = true;
     bool auPair = false;
     std::string ignore_ts_file;
+    std::size_t phrase_cache_size = 1 << 16;
+    std::size_t bubble_cache_size = 1 << 18; // with use_acceleration
 };
 
 struct Statistics
@@ -95,6 +147,36 @@ struct Statistics
     std::size_t parse_length = 0;
     std::size_t total_dictionary_length = 0;
     std::size_t num_of_phrases_dictionary = 0;
+    std::size_t phrase_cache_hits = 0;
+    std::size_t phrase_cache_misses = 0;
+    std::size_t bubble_cache_hits = 0;
+    std::size_t bubble_cache_misses = 0;
+};
+
+//------------------------------------------------------------------------------
+
+// Bounded direct mapped cache in front of a shared Dictionary, owned by a single parser. Hits are served without
+// taking any lock, only misses reach the Dictionary.
+class PhraseCache
+{
+private:
+    
+    struct Slot
+    {
+        hash_type hash = 0;
+        size_type id = 0;
+        std::string_view phrase; // phrases are never moved by the Dictionary
+    };
+    
+    std::vector<Slot> slots;
+    Dictionary* dictionary = nullptr;
+    
+public:
+    
+    std::size_t hits = 0, misses = 0;
+    
+    void init(Dictionary& d, std::size_t size);
+    size_type check_and_add_id(std::string_view phrase);
 };
 
 class ReferenceParse
@@ -102,7 +184,8 @@ class ReferenceParse
 
 public :
     Dictionary dictionary;
-    std::vector<hash_type> parse;
+    std::vector<size_type> parse; // phrase ids, ranks once a parser is closed
+    std::vector<size_type> occurrences; // by phrase id
     std::vector<size_type> trigger_strings_position; // position of first char of each trigger string
     std::set<hash_type> to_ignore_ts_hash;
     
@@ -111,7 +194,7 @@ public :
     void init(const std::string& reference);
     
     ReferenceParse(const std::string& reference, const Params& pms) : params(pms) { this->init(reference); }
-    const hash_type& operator[](size_type i) const { return this->parse[i]; }
+    const size_type& operator[](size_type i) const { return this->parse[i]; }
 };
 
 // Create a parse on disk
@@ -120,7 +203,7 @@ class ParserVCF
 
 private:
     
-    std::ofstream out_file;
+    AsyncWriter out_file;
     std::string out_file_prefix;
     std::string out_file_name;
     std::string tmp_out_file_name;
@@ -131,6 +214,13 @@ private:
     
     ReferenceParse* reference_parse = nullptr;
     Dictionary* dictionary = nullptr;
+    PhraseCache phrase_cache;
+    std::vector<size_type> occurrences; // by phrase id, only with compute_occurrences
+    std::vector<PhraseCache> segment_caches; // one per thread when a sample is split in segments
+    
+    // Phrase ids of the variant bubbles already parsed, by anchors and alleles inside
+    std::unordered_map<std::string, std::vector<size_type>> bubble_cache;
+    std::size_t bubble_cache_hits = 0, bubble_cache_misses = 0;
 
     // Shorthands
     hash_type w, p;
@@ -142,6 +232,14 @@ private:
     
     std::size_t working_genotype = 0;
     
+    // Where each parsed sample, or region of a sample, is in the temporary parse
+    struct ParsedSample { std::size_t order, region, begin, length; };
+    std::vector<ParsedSample> parsed_samples;
+    
+    void parse_segments(const Sample& sample, std::string& phrase);
+    void parse_bubbles(const Sample& sample, Sample::iterator& sample_iterator, std::string& phrase);
+    size_type last_phrase_id(const Sample& sample, std::string& phrase, std::size_t genotype);
+    
 public:
     
     enum tags
@@ -167,7 +265,7 @@ public:
     {
         close();
         size_type total_length = 0;
-        for (auto& entry : dictionary->hash_string_map) { total_length += entry.second.phrase.size(); }
+        dictionary->for_each([&](hash_type, std::string_view phrase) { total_length += phrase.size(); });
     
         // Fill out statistics
         this->statistics.parse_length = this->parse_size;
@@ -180,13 +278,17 @@ public:
         if (params.print_out_statistics_csv and (tags & MAIN))
         {
             std::ofstream csv(out_file_prefix + ".csv");
-            csv << "w,p,f,parse_lenght,dict_phrases,dict_tot_length\n";
+            std::size_t cache_lookups = statistics.phrase_cache_hits + statistics.phrase_cache_misses;
+            csv << "w,p,parse_lenght,dict_phrases,dict_tot_length,cache_size,cache_hits,cache_misses,cache_hit_rate\n";
             csv << params.w << ",";
             csv << params.p << ",";
             csv << statistics.parse_length << ",";
             csv << statistics.num_of_phrases_dictionary << ",";
             csv << statistics.total_dictionary_length << ",";
-            csv << "\n";
+            csv << params.phrase_cache_size << ",";
+            csv << statistics.phrase_cache_hits << ",";
+            csv << statistics.phrase_cache_misses << ",";
+            csv << (cache_lookups ? double(statistics.phrase_cache_hits) / cache_lookups : 0.0) << "\n";
             csv.close();
         }
     }
@@ -196,7 +298,17 @@ public:
     void register_worker(ParserVCF& parser) { this->registered_workers.push_back(std::ref(parser)); }
     void set_working_genotype(std::size_t genotype) { this->working_genotype = genotype; }
     
-    void operator()(const Sample& sample);
+    // Samples parsed by the workers are placed in the final parse by order, then by worker and call
+    static constexpr std::size_t unordered = std::numeric_limits<std::size_t>::max();
+    void operator()(const Sample& sample, std::size_t order = unordered);
+    
+    // Both haplotypes of a sample in one traversal, the stretches where they are the same are parsed once
+    void operator()(const Sample& sample, std::size_t h1_order, std::size_t h2_order);
+    
+    // Streaming: the samples are parsed one region at a time, between two anchors of all the variations read so far
+    // (npos for the start and the end of the samples). The regions are placed in the final parse by order, then region.
+    std::size_t region_end(const Variations& variations, std::size_t from, std::size_t read_position) const;
+    void operator()(const Sample& sample, std::size_t order, std::size_t region, std::size_t from, std::size_t to);
     void close();
 };
 
@@ -207,7 +319,7 @@ class ParserFasta
 
 private:
     
-    std::ofstream out_file;
+    AsyncWriter out_file;
     std::string out_file_prefix;
     std::string out_file_name;
     std::string in_file_path;
@@ -240,7 +352,7 @@ public:
     {
         close();
         size_type total_length = 0;
-        for (auto& entry : dictionary.hash_string_map) { total_length += entry.second.phrase.size(); }
+        dictionary.for_each([&](hash_type, std::string_view phrase) { total_length += phrase.size(); });
         
         // Fill out statistics
         this->statistics.parse_length = this->parse_size;
@@ -277,7 +389,7 @@ class ParserText
 
 private:
     
-    std::ofstream out_file;
+    AsyncWriter out_file;
     std::string out_file_prefix;
     std::string out_file_name;
     std::string in_file_path;
@@ -310,7 +422,7 @@ public:
     {
         close();
         size_type total_length = 0;
-        for (auto& entry : dictionary.hash_string_map) { total_length += entry.second.phrase.size(); }
+        dictionary.for_each([&](hash_type, std::string_view phrase) { total_length += phrase.size(); });
         
         // Fill out statistics
         this->statistics.parse_length = this->parse_size;
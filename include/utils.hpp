@@ -10,6 +10,8 @@
 #include <string>
 #include <string_view>
 #include <vector>
+#include <array>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <limits>
@@ -23,8 +25,11 @@
 #include <forward_list>
 #include <unordered_map>
 #include <cstring>
+#include <thread>
+#include <condition_variable>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <math.h>
 
 #include <spdlog/spdlog.h>
@@ -166,6 +171,85 @@ public:
     static hash_type string_hash(const std::string_view& s);
 };
 
+//------------------------------------------------------------------------------
+
+// Largest window accepted by pfp++, windows up to this size use the precomputed powers
+constexpr std::size_t kr_max_window = 200;
+
+// kr_constant^i mod kr_prime for i in [0, kr_max_window], computed at compile time
+constexpr std::array<hash_type, kr_max_window + 1> kr_powers = []()
+{
+    std::array<hash_type, kr_max_window + 1> powers {};
+    powers[0] = 1;
+    for (std::size_t i = 1; i < powers.size(); i++)
+    { powers[i] = (powers[i - 1] * KarpRabinHash::kr_constant) % KarpRabinHash::kr_prime; }
+    return powers;
+}();
+
+// Rolling hash over a window of W characters, W = 0 means the window length is given at runtime.
+// Produces the same hashes as KarpRabinHash with the default constant and prime.
+template <std::size_t W = 0>
+class KarpRabinWindow
+{
+public:
+    
+    KarpRabinWindow(std::size_t n = W) : window_length(n)
+    {
+        if constexpr (W != 0) { assert(n == W); }
+        if (length() <= kr_max_window) { constant_to_n_minus_one_mod = kr_powers[length() - 1]; }
+        else
+        {
+            constant_to_n_minus_one_mod = 1;
+            for (std::size_t i = 0; i < length() - 1; i++)
+            { constant_to_n_minus_one_mod = (constant_to_n_minus_one_mod * KarpRabinHash::kr_constant) % KarpRabinHash::kr_prime; }
+        }
+    }
+    
+    // Overwrites the current hash with the hash of the first length() characters of window
+    void initialize(const char* window)
+    {
+        hash_value = 0;
+        for (std::size_t i = 0; i < length(); i++)
+        { hash_value = ((hash_value * KarpRabinHash::kr_constant) + char_type(window[i])) % KarpRabinHash::kr_prime; }
+    }
+    void initialize(const std::string& window) { assert(window.size() == length()); initialize(window.data()); }
+    
+    void update(char_type char_out, char_type char_in)
+    {
+        hash_value = hash_value + KarpRabinHash::kr_prime; // negative avoider
+        hash_value = hash_value - ((constant_to_n_minus_one_mod * char_out) % KarpRabinHash::kr_prime);
+        hash_value = ((KarpRabinHash::kr_constant * hash_value) % KarpRabinHash::kr_prime) + char_in;
+        hash_value = hash_value % KarpRabinHash::kr_prime;
+    }
+    
+    void reset() { this->hash_value = 0; }
+    const hash_type& get_hash() const { return this->hash_value; }
+    
+    constexpr std::size_t length() const { if constexpr (W != 0) { return W; } else { return window_length; } }
+    
+private:
+    hash_type hash_value = 0;
+    hash_type constant_to_n_minus_one_mod;
+    std::size_t window_length;
+};
+
+// Calls f with a KarpRabinWindow specialized on w if one is available, with a runtime sized one otherwise
+template <typename Function>
+inline void
+with_kr_window(std::size_t w, Function&& f)
+{
+    switch (w)
+    {
+        case 10: f(KarpRabinWindow<10>()); break;
+        case 20: f(KarpRabinWindow<20>()); break;
+        default: f(KarpRabinWindow<>(w)); break;
+    }
+}
+
+// Appends to triggers the position i of the last character of every window text[i - w + 1, i], i in [w - 1, size),
+// whose Karp-Rabin hash is 0 modulo p. Uses AVX2 when the CPU supports it, a scalar rolling hash otherwise.
+void find_trigger_strings(const char* text, std::size_t size, std::size_t w, std::size_t p, std::vector<std::size_t>& triggers);
+
 
 //------------------------------------------------------------------------------
 
@@ -205,9 +289,86 @@ namespace DiskWrites
 
 //------------------------------------------------------------------------------
 
-bool ref_smaller(
-std::pair<std::reference_wrapper<std::string>, vcfbwt::hash_type> a,
-std::pair<std::reference_wrapper<std::string>, vcfbwt::hash_type> b);
+// Sorts by string with a parallel multikey quicksort on the OpenMP threads, chars are compared as unsigned like in
+// std::string comparisons
+void sort_strings(std::vector<std::pair<std::string_view, hash_type>>& strings);
+
+//------------------------------------------------------------------------------
+
+// Append-only byte storage in large blocks, stored bytes never move. Blocks grow geometrically up to
+// max_block_size, larger strings get a block of their own.
+class Arena
+{
+public:
+    
+    static constexpr std::size_t min_block_size = 16 * KILOBYTE;
+    static constexpr std::size_t max_block_size = 4 * MEGABYTE;
+    
+    struct Position
+    {
+        std::uint32_t block = 0;
+        std::uint32_t offset = 0;
+    };
+    
+    Position append(std::string_view bytes);
+    std::string_view view(Position position, std::size_t length) const
+    { return std::string_view(blocks[position.block].get() + position.offset, length); }
+    
+    std::size_t allocated() const { return allocated_bytes; }
+    
+private:
+    
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::size_t block_capacity = 0, block_used = 0, allocated_bytes = 0;
+};
+
+//------------------------------------------------------------------------------
+
+// Binary output file with two aligned buffers, a full buffer is written to disk by a background thread while the
+// other one is being filled. The bytes written are added to DiskWrites on close.
+class AsyncWriter
+{
+public:
+    
+    static constexpr std::size_t buffer_size = MEGABYTE;
+    static constexpr std::size_t buffer_alignment = 4 * KILOBYTE;
+    
+    AsyncWriter() = default;
+    explicit AsyncWriter(const std::string& file_name) { open(file_name); }
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+    ~AsyncWriter() { close(); }
+    
+    void open(const std::string& file_name);
+    void close();
+    bool is_open() const { return file_descriptor != -1; }
+    
+    void write(const char* data, std::size_t size);
+    void put(char c) { if (used == buffer_size) { swap_buffers(); } current[used++] = c; }
+    std::size_t tellp() const { return bytes_written + used; }
+    
+private:
+    
+    struct AlignedDelete { void operator()(char* buffer) const { std::free(buffer); } };
+    
+    std::array<std::unique_ptr<char[], AlignedDelete>, 2> buffers;
+    char* current = nullptr;
+    std::size_t used = 0, bytes_written = 0;
+    
+    std::string file_name;
+    int file_descriptor = -1;
+    
+    // Handed to the flushing thread
+    std::thread flusher;
+    std::mutex mutex;
+    std::condition_variable condition;
+    const char* pending = nullptr;
+    std::size_t pending_size = 0;
+    bool stop = false;
+    
+    void swap_buffers();
+    void flush_loop();
+};
 
 //------------------------------------------------------------------------------
 
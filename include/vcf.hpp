@@ -9,6 +9,7 @@
 
 #include <string_view>
 #include <vector>
+#include <filesystem>
 #include <unordered_map>
 #include <functional>
 
@@ -46,36 +47,134 @@ struct Variation
     enum variation_type { H1, H2, H12 };
 };
 
+// All the variations as a structure of arrays. The alleles of a variation, reference first, are stored one after
+// the other in a single byte pool, allele a of variation i starts at allele_offsets[first_allele[i] + a].
+class Variations
+{
+private:
+    
+    std::vector<std::size_t> positions, ref_lengths;
+    std::vector<double> frequencies;
+    std::vector<std::size_t> first_allele, allele_offsets;
+    std::string alleles_pool;
+    
+    friend class VCF;
+    
+public:
+    
+    Variations() : first_allele(1, 0), allele_offsets(1, 0) {}
+    
+    void push_back(const Variation& variation);
+    void append(const Variations& other, std::size_t from = 0); // the variations of other from id from
+    void drop_front(std::size_t n); // the ids of the variations left are shifted down by n
+    void clear();
+    
+    std::size_t size() const { return this->positions.size(); }
+    bool empty() const { return this->positions.empty(); }
+    std::size_t size_in_bytes() const;
+    
+    std::size_t pos(std::size_t i) const { return this->positions[i]; }
+    std::size_t ref_len(std::size_t i) const { return this->ref_lengths[i]; }
+    double freq(std::size_t i) const { return this->frequencies[i]; }
+    void set_freq(std::size_t i, double freq) { this->frequencies[i] = freq; }
+    
+    std::size_t alleles(std::size_t i) const { return this->first_allele[i + 1] - this->first_allele[i]; }
+    std::string_view allele(std::size_t i, std::size_t a) const
+    {
+        std::size_t k = this->first_allele[i] + a;
+        return std::string_view(this->alleles_pool.data() + this->allele_offsets[k], this->allele_offsets[k + 1] - this->allele_offsets[k]);
+    }
+};
+
 class Sample
 {
 private:
     
     const std::string& reference_;
-    const std::vector<Variation>& variations_list;
+    const Variations& variations_list;
     
     std::string sample_id;
     bool is_last_sample = false;
     int last_variation_type = 0;
+    
+    static constexpr std::size_t INDEX_STEP = 64;
+    
+    // Ids of the variations of the sample in variations_list, increasing and stored as varint deltas. The id of every
+    // INDEX_STEP-th variation and the offset of the delta after it allow to seek.
+    std::vector<uint8_t> variation_deltas;
+    std::vector<std::size_t> checkpoint_ids, checkpoint_offsets;
+    std::size_t number_of_variations = 0, last_id = 0;
+    
+    // Variations before first_variation were dropped while streaming, they are kept until compacted away
+    std::size_t first_variation = 0, read_variations = 0;
+    
+    // Alleles of each variation, one column per genotype, packed with allele_bits bits each
+    std::vector<std::vector<uint64_t>> allele_columns;
+    std::size_t allele_bits = 1;
+    
+    // Indels before every INDEX_STEP-th variation, by genotype, built once the variations are all added
+    std::vector<std::vector<long long int>> indels_index;
+    
+    // Position in the variations of the sample, decodes the ids on the fly
+    struct Cursor { std::size_t index = 0, id = 0, offset = 0; };
+    void seek(Cursor& cursor, std::size_t i) const;
+    void next(Cursor& cursor) const;
+    
+    long long int indel(const Cursor& cursor, std::size_t genotype) const;
+    long long int indels_before(std::size_t i, std::size_t genotype) const;
+    std::size_t first_at_or_after(std::size_t position, std::size_t from = 0) const;
+    std::size_t last_alternate_before(std::size_t i, std::size_t genotype) const;
+    void widen_alleles(std::size_t bits);
 
     friend class iterator;
+    friend class VCF;
     
 public:
     void set_last(const int type){  this->is_last_sample = true; this->last_variation_type = type; }
     bool last(const int type) const { return this->is_last_sample and ( type == this->last_variation_type ); }
 
-    // variation, variation type
-    std::vector<std::size_t> variations;
-    std::vector<std::vector<int>> genotypes;
-
     const std::string& id() const { return this->sample_id; }
     
-    Sample(const std::string& id, const std::string& ref, const std::vector<Variation>& variations)
+    Sample(const std::string& id, const std::string& ref, const Variations& variations)
     : sample_id(id), reference_(ref), variations_list(variations) {}
     
-    const Variation& get_variation(size_type i) const { return this->variations_list[variations[i]]; }
+    // Variations are added by increasing id, with the allele of each genotype
+    void add_variation(std::size_t id, const int* alleles, std::size_t n_alleles);
+    void add_variation(std::size_t id, const std::vector<int>& alleles) { add_variation(id, alleles.data(), alleles.size()); }
+    // The variations of other from id from_id, as ids base + (id - from_id) after the ones of the sample. The deltas
+    // and the allele columns are copied as they are.
+    void append(const Sample& other, std::size_t from_id = 0, std::size_t base = 0);
+    void drop_variations_before(std::size_t id); // hides them, ids are unchanged
+    void compact(std::size_t id); // follows Variations::drop_front(id)
+    
+    std::size_t variations_size() const { return this->number_of_variations - this->first_variation; }
+    std::size_t variations_read() const { return this->read_variations; } // the dropped ones too
+    std::size_t ploidy() const { return this->allele_columns.size(); }
+    std::size_t variation_id(std::size_t i) const { Cursor cursor; seek(cursor, i); return cursor.id; }
+    const Variations& get_variations() const { return this->variations_list; }
+    
+    int allele(std::size_t i, std::size_t genotype) const
+    {
+        if (genotype >= this->allele_columns.size()) { return 0; }
+        std::size_t bit = i * this->allele_bits;
+        return (this->allele_columns[genotype][bit / 64] >> (bit % 64)) & ((uint64_t(1) << this->allele_bits) - 1);
+    }
+    
+    // Calls f(i, id) on the variations of the sample in order, i starts from the first variation not dropped
+    template <typename Function>
+    void for_each_variation(Function&& f) const
+    {
+        Cursor cursor; seek(cursor, this->first_variation);
+        for (; cursor.index < this->number_of_variations; next(cursor)) { f(cursor.index, cursor.id); }
+    }
+    
+    std::size_t size_in_bytes() const;
     
     const std::string& get_reference() const { return this->reference_; }
     
+    // Seeking and sample lengths without walking all the variations
+    void build_index();
+    
     class iterator
     {
     private:
@@ -90,9 +189,20 @@ public:
         std::size_t sample_length_;
         const char* curr_char_;
         
+        // The variation at var_it_, its allele and its reference allele, decoded when var_it_ moves
+        Cursor cursor_;
+        std::size_t curr_pos_ = 0, curr_ref_len_ = 0;
+        std::string_view curr_alt_, curr_ref_;
+        
+        bool has_variation() const { return var_it_ < sample_.number_of_variations; }
+        
+        void to_alternate(std::size_t i);
+        bool skip_variations(std::size_t i);
+        
     public:
         
         iterator(const Sample& sample, std::size_t genotype = 0);
+        iterator(const Sample& sample, std::size_t genotype, std::size_t position); // position not inside a variation
         
         bool end();
         void operator++();
@@ -101,6 +211,12 @@ public:
         
         bool in_a_variation();
         
+        // Chars from the current one that are contiguous in memory: the reference up to the next variation or the
+        // rest of an allele. advance(n) moves forward by n <= span().size() chars.
+        std::string_view span() const;
+        bool on_reference() const;
+        void advance(std::size_t n);
+        
         std::size_t get_var_it() const { return var_it_; }
         std::size_t get_sam_it() const { return sam_it_; }
         std::size_t get_ref_it() const { return ref_it_ - 1; } // -1 because the iterator is pointing the next one
@@ -121,7 +237,7 @@ private:
     
     std::string reference;
     
-    std::vector<Variation> variations;
+    Variations variations;
     std::vector<Sample> samples;
     std::unordered_map<std::string, std::size_t> samples_id;
     
@@ -130,10 +246,55 @@ private:
     std::vector<std::size_t> populated_samples;
 
     std::vector<std::size_t> ref_sum_lengths;
+    
+    // An open vcf read one record at a time. Overlapping variations are skipped looking at the previous records of
+    // each sample, so that state is kept between records.
+    struct Reader
+    {
+        htsFile* file = nullptr;
+        bcf_hdr_t* header = nullptr;
+        bcf1_t* record = nullptr;
+        std::size_t offset = 0; // when using multiple vcfs
+        std::vector<std::size_t> samples; // by sample in the header, the index in the samples, npos if not wanted
+        std::vector<std::vector<int>> tppos;
+        std::vector<std::vector<bool>> prev_is_ins;
+        Variation variation;
+        int32_t* gt_arr = nullptr; int ngt_arr = 0; // genotypes of the last record, grown by htslib
+        std::vector<int> alleles;
+        
+        // A shard of an indexed vcf, only the records starting from begin. The index is not owned.
+        tbx_t* tbx_index = nullptr;
+        hts_itr_t* iterator = nullptr;
+        kstring_t line = { 0, 0, nullptr };
+        std::size_t begin = 0;
+        
+        // While settling, reading stops at the first record past the end of all the records read and of settled, its
+        // position with the offset is then in settled. From there on the records are decoded the same from any state.
+        bool settling = false;
+        std::size_t settled = 0;
+    };
+    
+    void open_vcf(Reader& reader, const std::string& vcf_path, Variations& l_variations, std::vector<Sample>& l_samples,
+                  std::unordered_map<std::string, std::size_t>& l_samples_id, std::size_t i = 0, bool add_samples = true);
+    bool read_record(Reader& reader, Variations& l_variations, std::vector<Sample>& l_samples);
+    void close_vcf(Reader& reader);
+    bool read_shards(Reader& reader, const std::string& vcf_path, Variations& l_variations, std::vector<Sample>& l_samples,
+                     std::unordered_map<std::string, std::size_t>& l_samples_id, std::size_t i);
+    
+    // Streaming, the vcfs are read up to a position at a time and the variations already parsed are dropped
+    bool streaming = false;
+    Reader stream;
+    std::vector<std::string> stream_vcfs_path;
+    std::size_t stream_vcf = 0, stream_position = 0, dropped_variations = 0;
+
+    // BGZF decompression threads, sized from the omp threads. Created before the first vcf is decoded and owned, so
+    // the VCF is never copied.
+    htsThreadPool thread_pool = { nullptr, 0 };
+    void init_thread_pool();
 
     void init_samples(const std::string& samples_path);
     
-    void init_vcf(const std::string& vcf_path, std::vector<Variation>& l_variations,
+    void init_vcf(const std::string& vcf_path, Variations& l_variations,
                   std::vector<Sample>& l_samples, std::unordered_map<std::string, std::size_t>& l_samples_id,
                   std::size_t i = 0);
     void init_vcf(const std::string& vcf_path, std::size_t i = 0);
@@ -141,6 +302,16 @@ private:
     
     void init_multi_vcf(const std::vector<std::string>& vcfs_path);
     void init_multi_ref(const std::vector<std::string>& refs_path);
+    void init_stream(const std::vector<std::string>& vcfs_path);
+    
+    // Variant cache, the reference, the variations and the samples of a set of vcfs in a binary file, valid as long as
+    // the hash of the content of the sources and the sample selection match. It's built from the selected samples
+    // only, a symbolic allele drops a record for the samples after it. Reading it copies the samples out.
+    static uint64_t sources_checksum(const std::vector<std::string>& refs_path, const std::vector<std::string>& vcfs_path,
+                                     const std::set<std::string>& samples, std::size_t max_samples);
+    void write_cache(const std::string& cache_path, uint64_t checksum) const;
+    bool read_cache(const std::string& cache_path, uint64_t checksum);
+    void init_cache(const std::vector<std::string>& refs_path, const std::vector<std::string>& vcfs_path, const std::string& cache_path);
 
 
 public:
@@ -152,28 +323,56 @@ public:
         if (samples_path != "") { init_samples(samples_path); }
         init_ref(ref_path); init_vcf(vcf_path);
         for (std::size_t i = 0; i < samples.size(); i++)
-        { if (not samples.at(i).variations.empty()) { this->populated_samples.push_back(i); } }
+        { if (samples.at(i).variations_size() != 0) { this->populated_samples.push_back(i); } }
 
         this->samples.at(populated_samples.back()).set_last(last_genotype);
+        for (std::size_t i : populated_samples) { this->samples[i].build_index(); }
     }
 
-    VCF(const std::vector<std::string> &refs_path, const std::vector<std::string> &vcfs_path, const std::string &samples_path, std::size_t ms = 0, const int last_genotype = 0) : max_samples(ms)
+    // When streaming no variation is read here, all the wanted samples are kept even if they have no variations yet.
+    // With a cache path the vcfs are read from the cache, built first if missing or stale.
+    VCF(const std::vector<std::string> &refs_path, const std::vector<std::string> &vcfs_path, const std::string &samples_path, std::size_t ms = 0, const int last_genotype = 0, bool streaming = false,
+        const std::string &cache_path = "") : max_samples(ms), streaming(streaming)
     {
+        if (streaming and cache_path != "") { spdlog::error("A variant cache can't be streamed"); std::exit(EXIT_FAILURE); }
         if (samples_path != "") { init_samples(samples_path); }
-        init_multi_ref(refs_path); init_multi_vcf(vcfs_path);
+        if (cache_path != "") { init_cache(refs_path, vcfs_path, cache_path); }
+        else
+        {
+            init_multi_ref(refs_path);
+            if (streaming) { init_stream(vcfs_path); } else { init_multi_vcf(vcfs_path); }
+        }
         for (std::size_t i = 0; i < samples.size(); i++)
-        { if (not samples.at(i).variations.empty()) { this->populated_samples.push_back(i); } }
+        {
+            bool wanted = streaming and (input_samples.empty() or input_samples.contains(samples.at(i).id()));
+            if (wanted or (samples.at(i).variations_size() != 0)) { this->populated_samples.push_back(i); }
+        }
 
         this->samples.at(populated_samples.back()).set_last(last_genotype);
+        if (not streaming) { for (std::size_t i : populated_samples) { this->samples[i].build_index(); } }
     }
     
-    ~VCF() = default;
+    VCF(const VCF&) = delete;
+    VCF& operator=(const VCF&) = delete;
+    
+    ~VCF()
+    {
+        if (this->stream.file != nullptr) { close_vcf(this->stream); }
+        if (this->thread_pool.pool != nullptr) { hts_tpool_destroy(this->thread_pool.pool); }
+    }
     
     std::size_t size() const { return this->populated_samples.size(); }
     Sample& operator[](std::size_t i) { assert(i < size()); return samples.at(populated_samples.at(i)); }
-    const std::vector<Variation>& get_variations() const { return this->variations; }
+    const Variations& get_variations() const { return this->variations; }
     const std::string& get_reference() const { return this->reference; }
     void set_max_samples(std::size_t max) { this->max_samples = max; }
+    
+    // Streaming: reads the records before position, the variations starting before it are then all loaded. Records
+    // are read whole, so some past position may be loaded too. read_position() is npos once all vcfs are read.
+    void read_until(std::size_t position);
+    std::size_t read_position() const { return this->stream_position; }
+    // Drops the variations starting up to position, they must not go past it
+    void drop_until(std::size_t position);
 };
 
 //------------------------------------------------------------------------------
@@ -27,6 +27,8 @@ int main(int argc, char **argv)
     bool only_trigger_strings = false;
     bool verbose = false;
     std::string haplotype_string = "1";
+    std::size_t region_size = 0;
+    std::string vcf_cache;
     
     vcfbwt::pfp::Params params;
     
@@ -41,7 +43,10 @@ int main(int argc, char **argv)
     app.add_option("-w, --window-size", params.w, "Sliding window size")->check(CLI::Range(3, 200))->configurable();
     app.add_option("-p, --modulo", params.p, "Module used during parisng")->check(CLI::Range(5, 20000))->configurable();
     app.add_option("-j, --threads", threads, "Number of threads")->configurable();
+    app.add_option("--region-size", region_size, "Stream the vcfs, parsing regions of about this many bases. 0 reads them whole")->configurable();
+    app.add_option("--vcf-cache", vcf_cache, "Binary cache of the vcfs and references for the selected samples, rebuilt if their hash or the selection changes. Loading copies the samples")->configurable();
     app.add_option("--tmp-dir", tmp_dir, "Tmp file directory")->check(CLI::ExistingDirectory)->configurable();
+    app.add_option("--phrase-cache-size", params.phrase_cache_size, "Entries of the per thread phrase cache, 0 disables it")->configurable();
     app.add_flag("-c, --compression", params.compress_dictionary, "Also output compressed the dictionary")->configurable();
     app.add_flag("--use-acceleration", params.use_acceleration, "Use reference parse to avoid re-parsing")->configurable();
     app.add_flag("--print-statistics", params.print_out_statistics_csv, "Print out csv containing stats")->configurable();
@@ -63,6 +68,9 @@ int main(int argc, char **argv)
     // Print out configurations
     spdlog::info("Current Configuration:\n{}", app.config_to_str(true,true));
     
+    // Set threads accordingly to configuration, also used to parse a single sequence in parallel
+    omp_set_num_threads(threads);
+    
     if (not fasta_file_path.empty())
     {
         if (out_prefix.empty()) { out_prefix = fasta_file_path; }
@@ -95,11 +103,8 @@ int main(int argc, char **argv)
             last_genotype = 1;
 
         // Parse the VCF
-        vcfbwt::VCF vcf(refs_file_names, vcfs_file_names, samples_file_name, max_samples, last_genotype);
+        vcfbwt::VCF vcf(refs_file_names, vcfs_file_names, samples_file_name, max_samples, last_genotype, region_size != 0, vcf_cache);
 
-        // Set threads accordingly to configuration
-        omp_set_num_threads(threads);
-    
         vcfbwt::pfp::ReferenceParse reference_parse(vcf.get_reference(), params);
     
         vcfbwt::pfp::ParserVCF main_parser(params, out_prefix, reference_parse);
@@ -112,35 +117,78 @@ int main(int argc, char **argv)
             main_parser.register_worker(workers[i]);
         }
 
-        if ( haplotype_string == "1" or haplotype_string == "2")
+        // Longest samples first, so the last ones to be scheduled are the cheapest
+        std::vector<std::size_t> schedule(vcf.size());
+        for (std::size_t i = 0; i < schedule.size(); i++) { schedule[i] = i; }
+        std::stable_sort(schedule.begin(), schedule.end(), [&](std::size_t a, std::size_t b)
+        { return vcf[a].variations_size() > vcf[b].variations_size(); });
+
+        if (region_size != 0)
+        {
+            if (haplotype_string == "2") { for (std::size_t i = 0; i < workers.size(); i++) { workers[i].set_working_genotype(1); } }
+            
+            // Each region ends at an anchor of the variations read so far, more are read until there is one. A sample
+            // is the reference until its first variation, it is parsed from its start once it has one. Samples without
+            // variations are never parsed, like when reading the vcfs whole.
+            std::size_t from = std::string::npos;
+            std::vector<uint8_t> started(vcf.size(), 0);
+            for (std::size_t region = 0; ; region++)
+            {
+                std::size_t first = ((from == std::string::npos) ? 0 : from) + region_size, to = std::string::npos;
+                for (std::size_t until = first; ; until += region_size)
+                {
+                    vcf.read_until(until);
+                    to = main_parser.region_end(vcf.get_variations(), first, vcf.read_position());
+                    if ((to != std::string::npos) or (vcf.read_position() == std::string::npos)) { break; }
+                }
+                spdlog::info("Processing region {}: {} variations, up to {}", region, vcf.get_variations().size(),
+                             (to == std::string::npos) ? vcf.get_reference().size() : to);
+                
+                #pragma omp parallel for schedule(dynamic, 1)
+                for (std::size_t i = 0; i < vcf.size(); i++)
+                {
+                    if (vcf[i].variations_read() == 0) { continue; }
+                    std::size_t sample_from = started[i] ? from : std::string::npos; started[i] = 1;
+                    
+                    vcfbwt::pfp::ParserVCF& worker = workers[omp_get_thread_num()];
+                    if (haplotype_string == "12")
+                    {
+                        worker.set_working_genotype(0); worker(vcf[i], 2 * i, region, sample_from, to);
+                        worker.set_working_genotype(1); worker(vcf[i], 2 * i + 1, region, sample_from, to);
+                    }
+                    else { worker(vcf[i], i, region, sample_from, to); }
+                }
+                
+                if (to == std::string::npos) { break; }
+                vcf.drop_until(to); from = to;
+            }
+        }
+        else if ( haplotype_string == "1" or haplotype_string == "2")
         {
             if (haplotype_string == "1") { for (std::size_t i = 0; i < workers.size(); i++) { workers[i].set_working_genotype(0); } }
             else { for (std::size_t i = 0; i < workers.size(); i++) { workers[i].set_working_genotype(1); } }
             
-            #pragma omp parallel for schedule(static)
-            for (std::size_t i = 0; i < vcf.size(); i++)
+            // With fewer samples than threads every sample is parsed in parallel segments instead
+            #pragma omp parallel for schedule(dynamic, 1) if(vcf.size() >= threads)
+            for (std::size_t s = 0; s < schedule.size(); s++)
             {
                 int this_thread = omp_get_thread_num();
+                std::size_t i = schedule[s];
                 spdlog::info("Processing sample [{}/{} H{}]: {}", i, vcf.size(), haplotype_string, vcf[i].id());
-                workers[this_thread](vcf[i]);
+                workers[this_thread](vcf[i], i);
             }
         }
         else if ( haplotype_string == "12" )
         {
-            #pragma omp parallel for schedule(static)
-            for (std::size_t i = 0; i < vcf.size(); i++)
+            #pragma omp parallel for schedule(dynamic, 1) if(vcf.size() >= threads)
+            for (std::size_t s = 0; s < schedule.size(); s++)
             {
                 int this_thread = omp_get_thread_num();
+                std::size_t i = schedule[s];
 
-                // get first genotype
-                workers[this_thread].set_working_genotype(0);
-                spdlog::info("Processing sample [{}/{} H{}]: {}", i, vcf.size(), 1, vcf[i].id());
-                workers[this_thread](vcf[i]);
-
-                // get second genotype
-                workers[this_thread].set_working_genotype(1);
-                spdlog::info("Processing sample [{}/{} H{}]: {}", i, vcf.size(), 2, vcf[i].id());
-                workers[this_thread](vcf[i]);
+                // both genotypes in one pass
+                spdlog::info("Processing sample [{}/{} H{}]: {}", i, vcf.size(), haplotype_string, vcf[i].id());
+                workers[this_thread](vcf[i], 2 * i, 2 * i + 1);
             }
         }
         
@@ -477,93 +477,93 @@ vcfbwt::pfp::AuPair::close()
     std::size_t final_size = 0;
     
     // sort dictionary
-    std::vector<std::pair<std::reference_wrapper<std::string>, hash_type>> sorted_phrases;
+    std::vector<std::pair<std::string_view, hash_type>> sorted_phrases;
     
     for (std::size_t i = 0; i < D_prime.d_prime_vector.size(); i++)
     {
         if (!D_prime.d_prime_vector[i].empty())
         {
-            sorted_phrases.emplace_back(std::ref(D_prime.d_prime_vector[i]), i);
+            sorted_phrases.emplace_back(D_prime.d_prime_vector[i], i);
         }
     }
     for (std::size_t i = 0; i < D_prime.d_prime_vector_additions.size(); i++)
     {
         if (!D_prime.d_prime_vector_additions[i].empty())
         {
-            sorted_phrases.emplace_back(std::ref(D_prime.d_prime_vector_additions[i]), i + D_prime.d_prime_vector.size());
+            sorted_phrases.emplace_back(D_prime.d_prime_vector_additions[i], i + D_prime.d_prime_vector.size());
         }
     }
     
-    std::sort(sorted_phrases.begin(), sorted_phrases.end(), ref_smaller);
+    sort_strings(sorted_phrases);
     
-    std::unordered_map<hash_type, size_type> hash_to_rank;
+    // Phrase ids are dense, 0 marks the removed ones
+    std::vector<size_type> hash_to_rank(D_prime.d_prime_vector.size() + D_prime.d_prime_vector_additions.size(), 0);
+    #pragma omp parallel for schedule(static)
     for (std::size_t i = 0; i < sorted_phrases.size(); i++) { hash_to_rank[sorted_phrases[i].second] = i + 1; }
     
     spdlog::info("AuPair: writing dictionary to disk NOT COMPRESSED");
     std::string dict_file_name = this->in_prefix + EXT::N_DICT;
-    std::ofstream dict(dict_file_name);
+    AsyncWriter dict(dict_file_name);
     
     for (auto& sorted_phrase : sorted_phrases)
     {
-        dict.write(sorted_phrase.first.get().c_str(), sorted_phrase.first.get().size());
+        dict.write(sorted_phrase.first.data(), sorted_phrase.first.size());
         dict.put(ENDOFWORD);
         
-        final_size += sorted_phrase.first.get().size();
+        final_size += sorted_phrase.first.size();
     }
     dict.put(ENDOFDICT);
-    vcfbwt::DiskWrites::update(dict.tellp()); // Disk Stats
     dict.close();
 
     if (this->compress_dictionary)
     {
         spdlog::info("Main parser: writing dictionary on disk COMPRESSED");
-        std::ofstream dicz(this->in_prefix + EXT::N_DICT_COMPRESSED);
-        std::ofstream lengths(this->in_prefix + EXT::N_DICT_COMPRESSED_LENGTHS);
+        AsyncWriter dicz(this->in_prefix + EXT::N_DICT_COMPRESSED);
+        AsyncWriter lengths(this->in_prefix + EXT::N_DICT_COMPRESSED_LENGTHS);
 
         for (size_type i = 0; i < sorted_phrases.size(); i++)
         {
             std::size_t shift = 1; // skip dollar on first phrase
             if (i != 0) { shift = this->window_length; }
-            dicz.write(sorted_phrases.at(i).first.get().c_str() + shift,
-                       sorted_phrases.at(i).first.get().size() - shift);
-            int32_t len = sorted_phrases.at(i).first.get().size() - shift;
+            dicz.write(sorted_phrases.at(i).first.data() + shift,
+                       sorted_phrases.at(i).first.size() - shift);
+            int32_t len = sorted_phrases.at(i).first.size() - shift;
             lengths.write((char*) &len, sizeof(int32_t));
         }
 
-        vcfbwt::DiskWrites::update(dicz.tellp()); // Disk Stats
         dicz.close();
-
-        vcfbwt::DiskWrites::update(lengths.tellp()); // Disk Stats
         lengths.close();
     }
     
     spdlog::info("AuPair: writing parse and .last to disk");
     std::string parse_file_name = this->in_prefix + EXT::N_PARSE;
-    std::ofstream parse_file(parse_file_name);
+    AsyncWriter parse_file(parse_file_name);
     std::string last_file_name = this->in_prefix + EXT::N_LAST;
-    std::ofstream last_file(last_file_name);
+    AsyncWriter last_file(last_file_name);
     std::string sai_file_name = this->in_prefix + EXT::N_SAI;
-    std::ofstream sai_file(sai_file_name);
+    AsyncWriter sai_file(sai_file_name);
     
     std::size_t pos_for_sai = 0;
     
     std::vector<size_type> occurrences(sorted_phrases.size(), 0);
     std::string occ_file_name = this->in_prefix + EXT::N_OCC;
-    std::ofstream occ_file(occ_file_name);
+    AsyncWriter occ_file(occ_file_name);
     
     auto* parse_it = this->parse.begin();
     while (parse_it != this->parse.end())
     {
-        if (hash_to_rank.find((*parse_it) - 1) == hash_to_rank.end())
+        size_type phrase_id = (*parse_it) - 1;
+        if ((phrase_id >= hash_to_rank.size()) or (hash_to_rank[phrase_id] == 0))
         {
-            spdlog::debug("Phrase {} not in the dictionary after compressing", (*parse_it) - 1);
+            spdlog::debug("Phrase {} not in the dictionary after compressing", phrase_id);
         }
         else
         {
-            parse_file.write((char*) &(hash_to_rank.at((*parse_it) - 1)), sizeof(size_type));
-            occurrences[hash_to_rank.at((*parse_it) - 1) - 1] += 1;
+            size_type rank = hash_to_rank[phrase_id];
+            parse_file.write((char*) &rank, sizeof(size_type));
+            occurrences[rank - 1] += 1;
     
-            const std::string& dict_string = sorted_phrases[hash_to_rank.at((*parse_it) - 1) - 1].first.get();
+            std::string_view dict_string = sorted_phrases[rank - 1].first;
             last_file.put(dict_string[(dict_string.size() - window_length) - 1]);
     
             if (pos_for_sai == 0) { pos_for_sai = dict_string.size() - 1; } // -1 is for the initial $ of the first word
@@ -575,17 +575,11 @@ vcfbwt::pfp::AuPair::close()
         parse_it = this->parse.next(parse_it);
     }
     
-    vcfbwt::DiskWrites::update(parse_file.tellp()); // Disk Stats
     parse_file.close();
-    
-    vcfbwt::DiskWrites::update(last_file.tellp());
     last_file.close();
-    
-    vcfbwt::DiskWrites::update(sai_file.tellp());
     sai_file.close();
     
     occ_file.write(reinterpret_cast<const char*>(occurrences.data()), sizeof(size_type) * occurrences.size());
-    vcfbwt::DiskWrites::update(occ_file.tellp()); // Disk Stats
     occ_file.close();
     
     spdlog::info("Compression ratio: {}%", (100 - std::size_t(((double(final_size) / double(this->initial_size)) * 100))));
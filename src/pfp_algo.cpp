@@ -8,74 +8,355 @@
 
 //------------------------------------------------------------------------------
 
-bool
-vcfbwt::pfp::Dictionary::contains(const std::string& phrase)
+namespace
 {
-    // lock the dictionary
-    std::lock_guard<std::mutex> guard(dictionary_mutex);
 
-    hash_type phrase_hash = string_hash(&(phrase[0]), phrase.size());
-    const auto& ptr = hash_string_map.find(phrase_hash);
+// Cuts the phrases ending at the given trigger strings out of text, text chars before from are already in phrase.
+// Phrases lying entirely inside text are passed to emit as views on text, the others are built in phrase. On return
+// phrase holds the open phrase.
+template <typename Function>
+void
+cut_phrases(std::string& phrase, const char* text, std::size_t from, std::size_t size, std::size_t w,
+            const std::vector<std::size_t>& triggers, Function&& emit)
+{
+    bool in_text = false; std::size_t phrase_start = 0;
+    for (std::size_t trigger : triggers)
+    {
+        if (in_text) { emit(std::string_view(text + phrase_start, trigger + 1 - phrase_start)); }
+        else
+        {
+            phrase.append(text + from, trigger + 1 - from); from = trigger + 1;
+            emit(std::string_view(phrase));
+            phrase.erase(phrase.begin(), phrase.end() - w); // Keep the last w chars
+        }
+        
+        // The next phrase starts with the trigger string, if it is inside text the phrase is too
+        if (trigger + 1 >= w) { in_text = true; phrase_start = trigger + 1 - w; }
+    }
+    
+    if (in_text) { phrase.assign(text + phrase_start, size - phrase_start); }
+    else { phrase.append(text + from, size - from); }
+}
+
+// Cuts text[0, size) at its trigger strings like cut_phrases, with the blocks of text parsed in parallel. A trigger
+// string only depends on its window, so every block finds its trigger strings on its own and a phrase crossing blocks
+// starts at the last trigger string of a previous block. The first phrase is head followed by the text up to the first
+// trigger string. keep filters the trigger strings and id_of must be thread safe. The ids and the trigger strings of
+// each block are passed to emit in text order. Returns the last trigger string, npos if there are none.
+template <typename KeepFunction, typename IdFunction, typename EmitFunction>
+std::size_t
+parallel_cut_phrases(const char* text, std::size_t size, std::size_t w, std::size_t p, std::string_view head,
+                     KeepFunction&& keep, IdFunction&& id_of, EmitFunction&& emit)
+{
+    constexpr std::size_t npos = std::string::npos;
+    
+    // Bounded memory, a round is a few blocks per thread
+    std::size_t round_size = 4 * std::size_t(omp_get_max_threads()) * vcfbwt::pfp::PARSING_BLOCK_SIZE;
+    std::size_t blocks_per_round = (round_size + vcfbwt::pfp::PARSING_BLOCK_SIZE - 1) / vcfbwt::pfp::PARSING_BLOCK_SIZE;
+    std::vector<std::vector<std::size_t>> block_triggers(blocks_per_round);
+    std::vector<std::vector<vcfbwt::size_type>> block_ids(blocks_per_round);
+    std::vector<std::size_t> previous_trigger(blocks_per_round);
+    
+    std::size_t last_trigger = npos;
+    for (std::size_t round_start = 0; round_start < size; round_start += round_size)
+    {
+        std::size_t blocks = std::min(blocks_per_round, (size - round_start + vcfbwt::pfp::PARSING_BLOCK_SIZE - 1) / vcfbwt::pfp::PARSING_BLOCK_SIZE);
+        
+        // Trigger strings, each block is preceded by the last w - 1 chars of the previous one
+        #pragma omp parallel for schedule(dynamic)
+        for (std::size_t b = 0; b < blocks; b++)
+        {
+            std::size_t block_start = round_start + (b * vcfbwt::pfp::PARSING_BLOCK_SIZE);
+            std::size_t block_end = std::min(block_start + vcfbwt::pfp::PARSING_BLOCK_SIZE, size);
+            std::size_t context = std::min<std::size_t>(block_start, w - 1);
+            
+            std::vector<std::size_t>& triggers = block_triggers[b]; triggers.clear();
+            vcfbwt::find_trigger_strings(text + block_start - context, block_end - block_start + context, w, p, triggers);
+            for (auto& trigger : triggers) { trigger += block_start - context; }
+            std::erase_if(triggers, [&](std::size_t trigger) { return not keep(trigger); });
+        }
+        
+        // Where the first phrase of each block starts
+        for (std::size_t b = 0; b < blocks; b++)
+        {
+            previous_trigger[b] = last_trigger;
+            if (not block_triggers[b].empty()) { last_trigger = block_triggers[b].back(); }
+        }
+        
+        // Phrases
+        #pragma omp parallel for schedule(dynamic)
+        for (std::size_t b = 0; b < blocks; b++)
+        {
+            const std::vector<std::size_t>& triggers = block_triggers[b];
+            block_ids[b].resize(triggers.size());
+            
+            std::size_t previous = previous_trigger[b];
+            for (std::size_t i = 0; i < triggers.size(); i++)
+            {
+                if (previous == npos)
+                {
+                    std::string phrase(head); phrase.append(text, triggers[i] + 1);
+                    block_ids[b][i] = id_of(std::string_view(phrase));
+                }
+                else { block_ids[b][i] = id_of(std::string_view(text + previous + 1 - w, triggers[i] - previous + w)); }
+                previous = triggers[i];
+            }
+        }
+        
+        for (std::size_t b = 0; b < blocks; b++) { emit(block_ids[b], block_triggers[b]); }
+    }
+    
+    return last_trigger;
+}
+
+// Cuts the phrases of a fasta sequence, phrase holds the open phrase before and after the sequence. Trigger strings
+// overlapping the end of the open phrase are included, except for its initial dollar.
+template <typename Function>
+void
+cut_record_phrases(std::string& phrase, const char* sequence, std::size_t sequence_length, std::size_t w, std::size_t p,
+                   std::string& boundary, std::vector<std::size_t>& triggers, Function&& emit)
+{
+    // Trigger strings overlapping the end of the current phrase, excluding the initial dollar
+    std::size_t context = std::min<std::size_t>(w - 1, phrase.size() - 1);
+    std::size_t head = std::min<std::size_t>(w - 1, sequence_length);
+    boundary.assign(phrase, phrase.size() - context, context);
+    boundary.append(sequence, head);
+    
+    triggers.clear();
+    vcfbwt::find_trigger_strings(boundary.data(), boundary.size(), w, p, triggers);
+    for (auto& trigger : triggers) { trigger -= context; }
+    
+    // Trigger strings inside the sequence
+    vcfbwt::find_trigger_strings(sequence, sequence_length, w, p, triggers);
+    
+    // Phrases inside the sequence are taken directly from the sequence buffer
+    cut_phrases(phrase, sequence, 0, sequence_length, w, triggers, emit);
+}
+
+// Parses a sample from sample_iterator up to the character on reference position last, included, or to its end. Blocks
+// are filled from the iterator, each one preceded by the last w - 1 chars of the open phrase.
+template <typename Function>
+void
+parse_sample_blocks(vcfbwt::Sample::iterator& sample_iterator, std::size_t last, std::string& phrase, std::size_t w,
+                    std::size_t p, const std::set<vcfbwt::hash_type>& to_ignore, std::string& buffer,
+                    std::vector<std::size_t>& triggers, Function&& emit)
+{
+    std::size_t context = w - 1;
+    buffer.resize(vcfbwt::pfp::PARSING_BLOCK_SIZE + w);
+    buffer.replace(0, context, phrase, phrase.size() - context, context);
+    
+    bool done = false;
+    while ((not done) and (not sample_iterator.end()))
+    {
+        std::size_t buffer_size = context;
+        while ((buffer_size < context + vcfbwt::pfp::PARSING_BLOCK_SIZE) and (not done) and (not sample_iterator.end()))
+        {
+            // Whole spans at once, a reference span is cut at position last
+            std::string_view span = sample_iterator.span();
+            std::size_t length = std::min(span.size(), context + vcfbwt::pfp::PARSING_BLOCK_SIZE - buffer_size);
+            std::size_t position = sample_iterator.get_ref_it();
+            if (not sample_iterator.on_reference()) { done = (position == last); if (done) { length = 1; } }
+            else if ((last != std::string::npos) and (position <= last) and (last - position < length)) { length = last - position + 1; done = true; }
+            
+            std::memcpy(&(buffer[buffer_size]), span.data(), length); buffer_size += length;
+            sample_iterator.advance(length);
+        }
+        
+        triggers.clear();
+        vcfbwt::find_trigger_strings(buffer.data(), buffer_size, w, p, triggers);
+        
+        if (not to_ignore.empty())
+        {
+            std::erase_if(triggers, [&](std::size_t trigger)
+            { return to_ignore.contains(vcfbwt::KarpRabinHash::string_hash(std::string_view(&(buffer[trigger + 1 - w]), w))); });
+        }
+        
+        cut_phrases(phrase, buffer.data(), context, buffer_size, w, triggers, emit);
+        
+        std::memmove(&(buffer[0]), &(buffer[buffer_size - context]), context);
+    }
+}
+
+// Occurrences are counted by phrase id while parsing, the vector grows with the dictionary
+inline void
+count_occurrence(std::vector<vcfbwt::size_type>& occurrences, vcfbwt::size_type id)
+{
+    if (id >= occurrences.size()) { occurrences.resize(std::max<std::size_t>(id + 1, 2 * occurrences.size()), 0); }
+    occurrences[id] += 1;
+}
+
+// Reference intervals changed by the variations of a sample, added by position. A reference trigger string that no
+// variation overlaps, and that is not followed by a variation right after it, is in the sample too and the sample parse
+// has a phrase ending there: it is an anchor, the parse of the sample and of the reference resync there.
+struct ChangedIntervals
+{
+    std::vector<std::size_t> begin, end_max = { 0 }; // running maximum of the ends
+    
+    void add(std::size_t pos, std::size_t ref_len)
+    {
+        begin.push_back(pos);
+        end_max.push_back(std::max(end_max.back(), pos + std::max<std::size_t>(ref_len, 1)));
+    }
     
-    return ((ptr != hash_string_map.end()) and (ptr->second.phrase == phrase));
+    // First anchor among the trigger strings in tsp[first, last), npos if none. Binary searches skip the trigger
+    // strings overlapped by a variation, so the cost depends on the variations and not on the trigger strings.
+    std::size_t next_anchor(const std::vector<vcfbwt::size_type>& tsp, std::size_t first, std::size_t last, std::size_t w) const
+    {
+        while (first < last)
+        {
+            std::size_t position = tsp[first];
+            std::size_t before = std::upper_bound(begin.begin(), begin.end(), position + w) - begin.begin();
+            if ((position >= w) and (end_max[before] <= position)) { return first; }
+            
+            std::size_t skip_to = std::max<std::size_t>(end_max[before], position + 1);
+            first = std::lower_bound(tsp.begin() + first + 1, tsp.begin() + last, skip_to) - tsp.begin();
+        }
+        return std::string::npos;
+    }
+};
+
+// Trigger strings that can be anchors, not the last one of the reference parse nor the ones too close to its end
+inline std::size_t
+anchors_end(const std::vector<vcfbwt::size_type>& tsp, std::size_t reference_size, std::size_t w)
+{
+    if (reference_size <= 3 * w) { return 0; }
+    return std::lower_bound(tsp.begin(), tsp.end() - 1, reference_size - 3 * w) - tsp.begin();
+}
+
+}
+
+//------------------------------------------------------------------------------
+
+const vcfbwt::pfp::Dictionary::DictionaryEntry*
+vcfbwt::pfp::Dictionary::Shard::find(hash_type hash) const
+{
+    if (slots.empty()) { return nullptr; }
+    
+    std::size_t mask = slots.size() - 1;
+    for (std::size_t i = hash & mask; slots[i].second.length != 0; i = (i + 1) & mask)
+    {
+        if (slots[i].first == hash) { return &(slots[i].second); }
+    }
+    return nullptr;
+}
+
+const vcfbwt::pfp::Dictionary::DictionaryEntry&
+vcfbwt::pfp::Dictionary::Shard::insert(hash_type hash, std::string_view phrase, size_type id)
+{
+    // Keep the load factor below 1/2
+    if (2 * (entries + 1) > slots.size())
+    {
+        std::vector<slot_type> old_slots(std::max<std::size_t>(2 * slots.size(), 256));
+        old_slots.swap(slots);
+        
+        std::size_t mask = slots.size() - 1;
+        for (const auto& slot : old_slots)
+        {
+            if (slot.second.length == 0) { continue; }
+            std::size_t i = slot.first & mask; while (slots[i].second.length != 0) { i = (i + 1) & mask; }
+            slots[i] = slot;
+        }
+    }
+    
+    DictionaryEntry entry; entry.position = arena.append(phrase); entry.length = phrase.size(); entry.id = id;
+    entries++;
+    
+    std::size_t mask = slots.size() - 1;
+    std::size_t i = hash & mask; while (slots[i].second.length != 0) { i = (i + 1) & mask; }
+    slots[i] = std::make_pair(hash, entry);
+    
+    return slots[i].second;
+}
+
+//------------------------------------------------------------------------------
+
+bool
+vcfbwt::pfp::Dictionary::contains(std::string_view phrase)
+{
+    hash_type phrase_hash = string_hash(phrase.data(), phrase.size());
+    
+    // lock the shard
+    Shard& shard = shard_of(phrase_hash);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    
+    const DictionaryEntry* entry = shard.find(phrase_hash);
+    return ((entry != nullptr) and (shard.phrase(*entry) == phrase));
 }
 
 vcfbwt::hash_type
-vcfbwt::pfp::Dictionary::add(const std::string& phrase)
+vcfbwt::pfp::Dictionary::add(std::string_view phrase)
 {
-    // lock the dictionary
-    std::lock_guard<std::mutex> guard(dictionary_mutex);
+    hash_type phrase_hash = string_hash(phrase.data(), phrase.size());
+    
+    // lock the shard
+    Shard& shard = shard_of(phrase_hash);
+    std::lock_guard<std::mutex> guard(shard.mutex);
 
     this->sorted = false;
     
-    hash_type phrase_hash = string_hash(&(phrase[0]), phrase.size());
-    if (hash_string_map.contains(phrase_hash))
+    if (shard.find(phrase_hash) != nullptr)
     {
         spdlog::error("Hash collision! Hash already in the dictionary");
         std::exit(EXIT_FAILURE);
     }
     
-    DictionaryEntry entry(phrase);
-    hash_string_map.insert(std::make_pair(phrase_hash, entry));
-
-    if (this->size() >= (std::numeric_limits<size_type>::max() - insertions_safe_guard))
+    std::size_t id = entries_number++;
+    if (id >= (std::numeric_limits<size_type>::max() - insertions_safe_guard))
     { spdlog::error("Dictionary too big for type {}", typeid(size_type).name()); std::exit(EXIT_FAILURE); }
+
+    shard.insert(phrase_hash, phrase, id);
     
     return phrase_hash;
 }
 
 vcfbwt::hash_type
-vcfbwt::pfp::Dictionary::check_and_add(const std::string &phrase)
+vcfbwt::pfp::Dictionary::check_and_add(std::string_view phrase)
 {
-    // lock the dictionary
-    std::lock_guard<std::mutex> guard(dictionary_mutex);
+    hash_type phrase_hash = string_hash(phrase.data(), phrase.size());
+    find_or_add(phrase_hash, phrase);
+    
+    return phrase_hash;
+}
+
+vcfbwt::size_type
+vcfbwt::pfp::Dictionary::check_and_add_id(std::string_view phrase)
+{
+    return find_or_add(string_hash(phrase.data(), phrase.size()), phrase).first;
+}
+
+std::pair<vcfbwt::size_type, std::string_view>
+vcfbwt::pfp::Dictionary::find_or_add(hash_type phrase_hash, std::string_view phrase)
+{
+    // lock the shard
+    Shard& shard = shard_of(phrase_hash);
+    std::lock_guard<std::mutex> guard(shard.mutex);
 
     // Check if present
-    hash_type phrase_hash = string_hash(&(phrase[0]), phrase.size());
-    const auto& ptr = hash_string_map.find(phrase_hash);
+    const DictionaryEntry* entry = shard.find(phrase_hash);
 
-    if ((ptr != hash_string_map.end()) and (ptr->second.phrase != phrase))
+    if ((entry != nullptr) and (shard.phrase(*entry) != phrase))
     {
         spdlog::error("Hash collision! Hash already in the dictionary for a different phrase");
         std::exit(EXIT_FAILURE);
     }
-    else if (ptr != hash_string_map.end()) { return phrase_hash; }
+    else if (entry != nullptr) { return std::make_pair(entry->id, shard.phrase(*entry)); }
 
     this->sorted = false;
 
-    DictionaryEntry entry(phrase);
-    hash_string_map.insert(std::make_pair(phrase_hash, entry));
-
-    if (this->size() >= (std::numeric_limits<size_type>::max() - insertions_safe_guard))
+    // ids are handed out in insertion order, dense over all the shards
+    std::size_t id = entries_number++;
+    if (id >= (std::numeric_limits<size_type>::max() - insertions_safe_guard))
     { spdlog::error("Dictionary too big for type {}", typeid(size_type).name()); std::exit(EXIT_FAILURE); }
 
-    return phrase_hash;
+    entry = &(shard.insert(phrase_hash, phrase, id));
+
+    return std::make_pair(entry->id, shard.phrase(*entry));
 }
 
 vcfbwt::hash_type
-vcfbwt::pfp::Dictionary::get(const std::string& phrase) const
+vcfbwt::pfp::Dictionary::get(std::string_view phrase) const
 {
-    return string_hash(&(phrase[0]), phrase.size());
+    return string_hash(phrase.data(), phrase.size());
 }
 
 void
@@ -84,41 +365,78 @@ vcfbwt::pfp::Dictionary::sort()
     // lock the dictionary
     std::lock_guard<std::mutex> guard(dictionary_mutex);
 
-    // sort the dictionary
-    for (auto& entry : this->hash_string_map)
+    // collect the phrases, each shard from its own offset
+    std::vector<std::size_t> shard_offsets(shards.size() + 1, 0);
+    for (std::size_t s = 0; s < shards.size(); s++) { shard_offsets[s + 1] = shard_offsets[s] + shards[s].entries; }
+    this->sorted_phrases.resize(shard_offsets.back());
+    
+    #pragma omp parallel for schedule(dynamic)
+    for (std::size_t s = 0; s < shards.size(); s++)
     {
-        this->sorted_phrases.emplace_back(std::ref(entry.second.phrase), entry.first);
+        std::size_t i = shard_offsets[s];
+        for (const auto& slot : shards[s].slots)
+        {
+            if (slot.second.length != 0) { sorted_phrases[i++] = std::make_pair(shards[s].phrase(slot.second), slot.first); }
+        }
     }
-    std::sort(sorted_phrases.begin(), sorted_phrases.end(), ref_smaller);
     
-    // insert in hashmap
-    this->hash_to_ranks.clear();
-    for (size_type i = 0; i < sorted_phrases.size(); i++)
+    // sort the dictionary
+    sort_strings(this->sorted_phrases);
+    
+    // id to rank permutation
+    this->ranks.resize(sorted_phrases.size());
+    #pragma omp parallel for schedule(static)
+    for (std::size_t i = 0; i < sorted_phrases.size(); i++)
     {
-        hash_to_ranks.insert(std::make_pair(sorted_phrases[i].second, i + 1)); // 1 based
+        ranks[shard_of(sorted_phrases[i].second).find(sorted_phrases[i].second)->id] = i + 1; // 1 based
     }
     
     this->sorted = true;
 }
 
-const std::string&
+std::string_view
 vcfbwt::pfp::Dictionary::sorted_entry_at(std::size_t i)
 {
-    std::lock_guard<std::mutex> guard(dictionary_mutex);
-    if (not this->sorted) { sort(); } return sorted_phrases[i].first.get();
+    if (not this->sorted) { sort(); } // sort() takes the lock itself
+    std::lock_guard<std::mutex> guard(dictionary_mutex); return sorted_phrases[i].first;
 }
 
 vcfbwt::size_type
 vcfbwt::pfp::Dictionary::hash_to_rank(hash_type hash)
 {
     if (not this->sorted) { sort(); }
-    auto it = hash_to_ranks.find(hash);
-    if (it != hash_to_ranks.end()) { return it->second; }
+    const DictionaryEntry* entry = shard_of(hash).find(hash);
+    if (entry != nullptr) { return ranks[entry->id]; }
     else { spdlog::error("Something went wrong"); std::exit(EXIT_FAILURE); }
 }
 
 //------------------------------------------------------------------------------
 
+void
+vcfbwt::pfp::PhraseCache::init(Dictionary& d, std::size_t size)
+{
+    this->dictionary = &d; this->hits = 0; this->misses = 0;
+    this->slots.assign(size == 0 ? 0 : std::bit_ceil(size), Slot());
+}
+
+vcfbwt::size_type
+vcfbwt::pfp::PhraseCache::check_and_add_id(std::string_view phrase)
+{
+    hash_type phrase_hash = string_hash(phrase.data(), phrase.size());
+    if (slots.empty()) { misses++; return dictionary->find_or_add(phrase_hash, phrase).first; }
+    
+    Slot& slot = slots[phrase_hash & (slots.size() - 1)];
+    if ((slot.phrase.data() != nullptr) and (slot.hash == phrase_hash) and (slot.phrase == phrase)) { hits++; return slot.id; }
+    
+    // Miss, go through the shared dictionary and replace the slot
+    misses++;
+    slot.hash = phrase_hash; std::tie(slot.id, slot.phrase) = dictionary->find_or_add(phrase_hash, phrase);
+    
+    return slot.id;
+}
+
+//------------------------------------------------------------------------------
+
 void
 vcfbwt::pfp::ReferenceParse::init(const std::string& reference)
 {
@@ -142,39 +460,32 @@ vcfbwt::pfp::ReferenceParse::init(const std::string& reference)
         spdlog::info("To be ingored trigger strings: {}", this->to_ignore_ts_hash.size());
     }
     
-    std::string phrase;
     spdlog::info("Parsing reference");
     
-    // Karp Robin Hash Function for sliding window
-    KarpRabinHash kr_hash(this->params.w);
-    
     // Reference as first sample, just one dollar to be compatible with Giovanni's pscan.cpp
-    phrase.append(1, DOLLAR);
+    std::string head(1, DOLLAR);
     
-    for (std::size_t ref_it = 0; ref_it < reference.size(); ref_it++)
+    auto keep = [&](std::size_t trigger)
     {
-        char c = reference[ref_it];
-        
-        phrase.push_back(c);
-        if (phrase.size() == params.w) { kr_hash.initialize(phrase); }
-        else if (phrase.size() > params.w) { kr_hash.update(phrase[phrase.size() - params.w - 1], phrase[phrase.size() - 1]); }
-        
-        if ((phrase.size() > this->params.w) and ((kr_hash.get_hash() % this->params.p) == 0))
+        if (to_ignore_ts_hash.empty()) { return true; }
+        return not to_ignore_ts_hash.contains(KarpRabinHash::string_hash(std::string_view(&(reference[trigger + 1 - params.w]), params.w)));
+    };
+    auto id_of = [&](std::string_view phrase) { return this->dictionary.check_and_add_id(phrase); };
+    auto emit = [&](const std::vector<size_type>& ids, const std::vector<std::size_t>& triggers)
+    {
+        for (std::size_t i = 0; i < ids.size(); i++)
         {
-            std::string_view ts(&(phrase[phrase.size() - params.w]), params.w);
-            hash_type ts_hash = KarpRabinHash::string_hash(ts);
-            if (to_ignore_ts_hash.contains(ts_hash)) { continue; }
-            
-            hash_type hash = this->dictionary.check_and_add(phrase);
-            
-            this->parse.push_back(hash);
-            this->trigger_strings_position.push_back(ref_it - this->params.w + 1);
-    
-            phrase.erase(phrase.begin(), phrase.end() - this->params.w); // Keep the last w chars
-            
-            kr_hash.reset(); kr_hash.initialize(phrase);
+            if (params.compute_occurrences) { count_occurrence(this->occurrences, ids[i]); }
+            this->parse.push_back(ids[i]);
+            this->trigger_strings_position.push_back(triggers[i] + 1 - this->params.w);
         }
-    }
+    };
+    
+    std::size_t last_trigger = parallel_cut_phrases(reference.data(), reference.size(), params.w, params.p, head, keep, id_of, emit);
+    
+    std::string phrase;
+    if (last_trigger == std::string::npos) { phrase = head + reference; }
+    else { phrase.assign(reference, last_trigger + 1 - params.w); }
     
     // Last phrase
     if (phrase.size() > this->params.w)
@@ -183,9 +494,10 @@ vcfbwt::pfp::ReferenceParse::init(const std::string& reference)
         phrase.append(this->params.w - 1, DOLLAR_PRIME);
         phrase.append(1, DOLLAR_SEQUENCE);
     
-        hash_type hash = this->dictionary.check_and_add(phrase);
+        size_type id = this->dictionary.check_and_add_id(phrase);
+        if (params.compute_occurrences) { count_occurrence(this->occurrences, id); }
     
-        this->parse.push_back(hash);
+        this->parse.push_back(id);
         this->trigger_strings_position.push_back(reference.size() - 1);
     }
     else { spdlog::error("The reference doesn't have w dollar prime at the end!"); std::exit(EXIT_FAILURE); }
@@ -202,119 +514,396 @@ vcfbwt::pfp::ParserVCF::init(const Params& params, const std::string& prefix, Re
     if (tags & MAIN) {this->out_file_name = out_file_prefix + EXT::PARSE; }
     if ((tags & MAIN) and params.compress_dictionary) { tags = tags | COMPRESSED; }
     this->tmp_out_file_name = TempFile::getName("parse");
-    this->out_file.open(tmp_out_file_name, std::ios::binary);
+    this->out_file.open(tmp_out_file_name);
     this->reference_parse = &rp;
     this->dictionary = &this->reference_parse->dictionary;
+    this->phrase_cache.init(*this->dictionary, params.phrase_cache_size);
     
     this->params = params;
 }
 
 void
-vcfbwt::pfp::ParserVCF::operator()(const vcfbwt::Sample& sample)
+vcfbwt::pfp::ParserVCF::operator()(const vcfbwt::Sample& sample, std::size_t order)
 {
     Sample::iterator sample_iterator(sample, this->working_genotype);
     this->samples_processed.push_back(sample.id());
+    std::size_t sample_begin = this->parse_size;
     
     std::string phrase;
     
-    // Karp Robin Hash Function for sliding window
-    KarpRabinHash kr_hash(this->params.w);
-    
     // Every sample starts with w-1 dollar prime and one dollar seq
     phrase.append(this->w - 1, DOLLAR_PRIME);
     phrase.append(1, DOLLAR_SEQUENCE);
-    kr_hash.initialize(phrase);
-    
-    // Shorthands
-    std::vector<size_type>& tsp = reference_parse->trigger_strings_position;
     
-    std::size_t start_window = 0, end_window = 0;
-    while (not sample_iterator.end())
+    if (params.use_acceleration) { parse_bubbles(sample, sample_iterator, phrase); }
+    else
     {
-        // Compute where we are on the reference
-        std::size_t pos_on_reference = sample_iterator.get_ref_it();
-        
-        if ( not ((sample_iterator.get_var_it() > 0) and (sample_iterator.prev_variation() > (pos_on_reference - (8 * this->w)))))
+        auto emit = [&](std::string_view view)
         {
-            // Set start postion to the position in the reference parse after the last computed phrase
-            if (params.use_acceleration and ((phrase.size() == this->w) and ((pos_on_reference != 0) and (phrase[0] != DOLLAR_PRIME))))
-            {
-                start_window = end_window;
-                while ((tsp[start_window] + this->w) <= pos_on_reference and (start_window < tsp.size() - 2))
-                { start_window++; }
-    
-                // Iterate over the parse up to the next variation
-                while (tsp[end_window + 1] < (sample_iterator.next_variation() - (this->w + 1))) { end_window++; }
-                
-                // If the window is not empty
-                if ((start_window < end_window - 1) and (tsp[end_window] > pos_on_reference))
-                {
-                    spdlog::debug("------------------------------------------------------------");
-                    spdlog::debug("from {}", sample.get_reference().substr(tsp[start_window - 1], this->w));
-                    spdlog::debug("copied from {} to {}", tsp[start_window], tsp[end_window] + this->w);
-                    spdlog::debug("next variation: {}", sample_iterator.next_variation());
-                    spdlog::debug("skipped phrases: {}", end_window - start_window);
-                    
-                    // copy from parse[start_window : end_window]
-                    out_file.write((char*) &(this->reference_parse->parse[start_window]), sizeof(hash_type) * (end_window - start_window + 1));
-                    this->parse_size += end_window - start_window + 1;
+            size_type id = this->phrase_cache.check_and_add_id(view);
+            if (params.compute_occurrences) { count_occurrence(this->occurrences, id); }
             
-                    // move iterators and re initialize phrase
-                    sample_iterator.go_to(tsp[end_window]);
-                    phrase.clear();
-                    for (std::size_t i = 0; i < this->w; i++) { ++sample_iterator; phrase.push_back(*sample_iterator);}
-                    
-                    kr_hash.reset(); kr_hash.initialize(phrase);
-                    
-                    ++sample_iterator;
-                    spdlog::debug("New phrase [{}]: {}", phrase.size(), phrase);
-                    spdlog::debug("------------------------------------------------------------");
-                }
+            out_file.write((char*) (&id), sizeof(size_type)); this->parse_size += 1;
+            
+            if (view[0] != DOLLAR_PRIME)
+            {
+                spdlog::debug("------------------------------------------------------------");
+                spdlog::debug("Parsed phrase [{}] {}", view.size(), view);
+                spdlog::debug("------------------------------------------------------------");
             }
-        }
+        };
         
-        // Next phrase should contain a variation so parse as normal, also if we don't
-        // want to use the acceleration we should always end up here
-        phrase.push_back(*sample_iterator);
-        kr_hash.update(phrase[phrase.size() - params.w - 1], phrase[phrase.size() - 1]);
-        ++sample_iterator;
+        // With idle threads the sample is split in segments parsed in parallel
+        if ((not omp_in_parallel()) and (omp_get_max_threads() > 1)) { parse_segments(sample, phrase); }
+        else
+        {
+            std::string buffer; std::vector<std::size_t> triggers;
+            parse_sample_blocks(sample_iterator, std::string::npos, phrase, this->w, this->p,
+                                this->reference_parse->to_ignore_ts_hash, buffer, triggers, emit);
+        }
+    }
+    
+    // Last phrase
+    size_type id = last_phrase_id(sample, phrase, this->working_genotype);
+    out_file.write((char*) (&id), sizeof(size_type));   this->parse_size += 1;
     
-        if ((phrase.size() > this->params.w) and ((kr_hash.get_hash() % this->params.p) == 0))
+    this->parsed_samples.push_back({ order, 0, sample_begin, this->parse_size - sample_begin });
+}
+
+void
+vcfbwt::pfp::ParserVCF::parse_bubbles(const Sample& sample, Sample::iterator& sample_iterator, std::string& phrase)
+{
+    constexpr std::size_t npos = std::string::npos;
+    const std::string& reference = sample.get_reference();
+    const std::vector<size_type>& tsp = this->reference_parse->trigger_strings_position;
+    const std::vector<size_type>& reference_ids = this->reference_parse->parse;
+    
+    // Variations with an alternate allele on this genotype
+    struct Alternate { std::size_t pos, variation; int allele; };
+    ChangedIntervals changed; std::vector<Alternate> alternates;
+    const vcfbwt::Variations& variations = sample.get_variations();
+    sample.for_each_variation([&](std::size_t i, std::size_t var_id)
+    {
+        int allele = sample.allele(i, this->working_genotype);
+        if (allele == 0) { return; }
+        changed.add(variations.pos(var_id), variations.ref_len(var_id)); alternates.push_back({ variations.pos(var_id), var_id, allele });
+    });
+    
+    auto write_ids = [&](const size_type* ids, std::size_t length)
+    {
+        out_file.write((char*) ids, length * sizeof(size_type)); this->parse_size += length;
+        if (params.compute_occurrences) { for (std::size_t i = 0; i < length; i++) { count_occurrence(this->occurrences, ids[i]); } }
+    };
+    
+    // The sample is cut at the anchors, a bubble goes from the anchor at tsp[from] to the one at tsp[to]. Without
+    // variations inside, its phrases are the ones of the reference parse. Otherwise its phrases only depend on the
+    // anchors and on the alleles inside, so they are cached for the next samples. The iterator only moves when
+    // a bubble is parsed.
+    std::size_t from = npos, next_alternate = 0;
+    std::string key, buffer; std::vector<std::size_t> triggers; std::vector<size_type> ids;
+    auto parse_bubble = [&](std::size_t to)
+    {
+        std::size_t first_alternate = next_alternate;
+        key.assign((const char*) &from, sizeof(from)); key.append((const char*) &to, sizeof(to));
+        while ((next_alternate < alternates.size()) and ((to == npos) or (alternates[next_alternate].pos < tsp[to])))
         {
-            std::string_view ts(&(phrase[phrase.size() - params.w]), params.w);
-            hash_type ts_hash = KarpRabinHash::string_hash(ts);
-            if (this->reference_parse->to_ignore_ts_hash.contains(ts_hash)) { continue; }
-            
-            hash_type hash = this->dictionary->check_and_add(phrase);
+            std::size_t variation = alternates[next_alternate].variation;
+            int allele = alternates[next_alternate].allele;
+            key.append((const char*) &variation, sizeof(variation)); key.append((const char*) &allele, sizeof(allele));
+            next_alternate++;
+        }
+        
+        if ((from != npos) and (to != npos) and (first_alternate == next_alternate))
+        { write_ids(&(reference_ids[from + 1]), to - from); from = to; return; }
         
-            out_file.write((char*) (&hash), sizeof(hash_type)); this->parse_size += 1;
+        // The last bubble is never cached, it leaves the last phrase open
+        auto cached = (to == npos) ? bubble_cache.end() : bubble_cache.find(key);
+        if (cached != bubble_cache.end())
+        {
+            this->bubble_cache_hits++;
+            write_ids(cached->second.data(), cached->second.size()); from = to; return;
+        }
+        if (to != npos) { this->bubble_cache_misses++; }
+        
+        if (from != npos) { sample_iterator.go_to(tsp[from] + this->w + 1); phrase.assign(reference, tsp[from], this->w); }
+        std::size_t last = (to == npos) ? npos : tsp[to] + this->w - 1;
+        
+        ids.clear();
+        parse_sample_blocks(sample_iterator, last, phrase, this->w, this->p, this->reference_parse->to_ignore_ts_hash,
+                            buffer, triggers, [&](std::string_view view) { ids.push_back(this->phrase_cache.check_and_add_id(view)); });
+        write_ids(ids.data(), ids.size());
+        
+        if (to != npos)
+        {
+            if (bubble_cache.size() >= params.bubble_cache_size) { bubble_cache.clear(); }
+            bubble_cache.emplace(key, ids);
+        }
+        from = to;
+    };
     
-            if (phrase[0] != DOLLAR_PRIME)
-            {
-                spdlog::debug("------------------------------------------------------------");
-                spdlog::debug("Parsed phrase [{}] {}", phrase.size(), phrase);
-                spdlog::debug("------------------------------------------------------------");
-            }
-            
-            phrase.erase(phrase.begin(), phrase.end() - this->w); // Keep the last w chars
+    // Between a bubble and the next variation every trigger string is an anchor, the whole stretch is copied
+    std::size_t last_anchor = anchors_end(tsp, reference.size(), this->w);
+    for (std::size_t to = changed.next_anchor(tsp, 0, last_anchor, this->w); to != npos; to = changed.next_anchor(tsp, from + 1, last_anchor, this->w))
+    {
+        parse_bubble(to);
+        
+        std::size_t next_variation = (next_alternate < alternates.size()) ? alternates[next_alternate].pos : reference.size();
+        std::size_t stretch_end = std::lower_bound(tsp.begin() + from, tsp.begin() + last_anchor, next_variation - this->w) - tsp.begin();
+        if (stretch_end > from + 1) { write_ids(&(reference_ids[from + 1]), stretch_end - 1 - from); from = stretch_end - 1; }
+    }
+    parse_bubble(npos);
+}
+
+vcfbwt::size_type
+vcfbwt::pfp::ParserVCF::last_phrase_id(const Sample& sample, std::string& phrase, std::size_t genotype)
+{
+    if (phrase.size() <= this->w) { spdlog::error("A sample doesn't have w dollar prime at the end!"); std::exit(EXIT_FAILURE); }
+    
+    // Append w dollar prime at the end of each sample, also w DOLLAR if it's the last sample
+    phrase.append(this->w - 1, DOLLAR_PRIME);
+    if (sample.last(genotype)) { phrase.append(this->w, DOLLAR); }
+    else { phrase.append(1, DOLLAR_SEQUENCE); }
     
-            kr_hash.reset(); kr_hash.initialize(phrase);
+    size_type id = this->phrase_cache.check_and_add_id(phrase);
+    if (params.compute_occurrences) { count_occurrence(this->occurrences, id); }
+    return id;
+}
+
+void
+vcfbwt::pfp::ParserVCF::operator()(const vcfbwt::Sample& sample, std::size_t h1_order, std::size_t h2_order)
+{
+    // The acceleration copies the reference stretches already and idle threads split each haplotype in segments
+    if (params.use_acceleration or ((not omp_in_parallel()) and (omp_get_max_threads() > 1)))
+    {
+        std::size_t genotype = this->working_genotype;
+        this->working_genotype = 0; (*this)(sample, h1_order);
+        this->working_genotype = 1; (*this)(sample, h2_order);
+        this->working_genotype = genotype;
+        return;
+    }
+    
+    const std::string& reference = sample.get_reference();
+    const std::vector<size_type>& tsp = this->reference_parse->trigger_strings_position;
+    
+    // Reference intervals changed by either haplotype, and the positions of the variations with different
+    // alleles on the two haplotypes
+    ChangedIntervals changed; std::vector<std::size_t> heterozygous;
+    const vcfbwt::Variations& variations = sample.get_variations();
+    sample.for_each_variation([&](std::size_t i, std::size_t var_id)
+    {
+        int h1 = sample.allele(i, 0), h2 = sample.allele(i, 1);
+        if (h1 == 0 and h2 == 0) { return; }
+        changed.add(variations.pos(var_id), variations.ref_len(var_id));
+        if (h1 != h2) { heterozygous.push_back(variations.pos(var_id)); }
+    });
+    
+    // Both haplotypes have a phrase ending at the anchors. The runs between them are shared when there are
+    // no heterozygous variations inside, consecutive runs of the same kind are merged.
+    struct Run { std::size_t last; bool shared; };
+    std::vector<Run> runs;
+    std::size_t next_heterozygous = 0;
+    auto add_run = [&](std::size_t end)
+    {
+        bool shared = (next_heterozygous == heterozygous.size()) or (heterozygous[next_heterozygous] >= end);
+        while (next_heterozygous < heterozygous.size() and heterozygous[next_heterozygous] < end) { next_heterozygous++; }
+        
+        std::size_t last = (end == std::string::npos) ? std::string::npos : end + this->w - 1;
+        if ((not runs.empty()) and (runs.back().shared == shared)) { runs.back().last = last; }
+        else { runs.push_back({ last, shared }); }
+    };
+    std::size_t last_anchor = anchors_end(tsp, reference.size(), this->w);
+    for (std::size_t i = changed.next_anchor(tsp, 0, last_anchor, this->w); i != std::string::npos; i = changed.next_anchor(tsp, i + 1, last_anchor, this->w))
+    { add_run(tsp[i]); }
+    add_run(std::string::npos);
+    
+    this->samples_processed.push_back(sample.id());
+    this->samples_processed.push_back(sample.id());
+    std::size_t h1_begin = this->parse_size;
+    
+    // Every sample starts with w-1 dollar prime and one dollar seq
+    std::string h1_phrase, h2_phrase;
+    h1_phrase.append(this->w - 1, DOLLAR_PRIME);
+    h1_phrase.append(1, DOLLAR_SEQUENCE);
+    h2_phrase = h1_phrase;
+    
+    Sample::iterator h1_iterator(sample, 0), h2_iterator(sample, 1);
+    
+    // The first haplotype is written while parsing, the second one after it
+    std::vector<size_type> h2_ids;
+    auto emit_h1 = [&](std::string_view view)
+    {
+        size_type id = this->phrase_cache.check_and_add_id(view);
+        if (params.compute_occurrences) { count_occurrence(this->occurrences, id); }
+        out_file.write((char*) (&id), sizeof(size_type)); this->parse_size += 1;
+        return id;
+    };
+    auto emit_h2 = [&](std::string_view view)
+    {
+        size_type id = this->phrase_cache.check_and_add_id(view);
+        if (params.compute_occurrences) { count_occurrence(this->occurrences, id); }
+        h2_ids.push_back(id);
+    };
+    auto emit_both = [&](std::string_view view)
+    {
+        size_type id = emit_h1(view);
+        if (params.compute_occurrences) { count_occurrence(this->occurrences, id); }
+        h2_ids.push_back(id);
+    };
+    
+    std::string buffer; std::vector<std::size_t> triggers;
+    const std::set<hash_type>& to_ignore = this->reference_parse->to_ignore_ts_hash;
+    for (const Run& run : runs)
+    {
+        if (run.shared)
+        {
+            // The second haplotype only moves to where the first one stopped
+            parse_sample_blocks(h1_iterator, run.last, h1_phrase, this->w, this->p, to_ignore, buffer, triggers, emit_both);
+            h2_phrase = h1_phrase;
+            if (run.last != std::string::npos) { h2_iterator.go_to(run.last + 2); }
+        }
+        else
+        {
+            parse_sample_blocks(h1_iterator, run.last, h1_phrase, this->w, this->p, to_ignore, buffer, triggers, emit_h1);
+            parse_sample_blocks(h2_iterator, run.last, h2_phrase, this->w, this->p, to_ignore, buffer, triggers, emit_h2);
         }
     }
     
-    // Last phrase
-    if (phrase.size() > this->w)
+    // Last phrases
+    size_type id = last_phrase_id(sample, h1_phrase, 0);
+    out_file.write((char*) (&id), sizeof(size_type)); this->parse_size += 1;
+    this->parsed_samples.push_back({ h1_order, 0, h1_begin, this->parse_size - h1_begin });
+    
+    h2_ids.push_back(last_phrase_id(sample, h2_phrase, 1));
+    out_file.write((char*) h2_ids.data(), h2_ids.size() * sizeof(size_type));
+    this->parsed_samples.push_back({ h2_order, 0, this->parse_size, h2_ids.size() });
+    this->parse_size += h2_ids.size();
+}
+
+std::size_t
+vcfbwt::pfp::ParserVCF::region_end(const Variations& variations, std::size_t from, std::size_t read_position) const
+{
+    const std::vector<size_type>& tsp = this->reference_parse->trigger_strings_position;
+    
+    // An anchor of all the variations is an anchor of every haplotype. It has to be at or after from, and the
+    // variations starting up to w chars after it have to be read already. The last trigger string ends the reference.
+    ChangedIntervals changed;
+    for (std::size_t i = 0; i < variations.size(); i++) { changed.add(variations.pos(i), variations.ref_len(i)); }
+    
+    std::size_t last = anchors_end(tsp, tsp.back() + 1, this->w);
+    if (read_position != std::string::npos)
     {
-        // Append w dollar prime at the end of each sample, also w DOLLAR if it's the last sample
+        if (read_position <= this->w) { return std::string::npos; }
+        last = std::min<std::size_t>(last, std::lower_bound(tsp.begin(), tsp.end(), read_position - this->w) - tsp.begin());
+    }
+    std::size_t first = std::lower_bound(tsp.begin(), tsp.end(), from) - tsp.begin();
+    
+    std::size_t anchor = changed.next_anchor(tsp, first, std::max(first, last), this->w);
+    return (anchor == std::string::npos) ? anchor : tsp[anchor];
+}
+
+void
+vcfbwt::pfp::ParserVCF::operator()(const vcfbwt::Sample& sample, std::size_t order, std::size_t region, std::size_t from, std::size_t to)
+{
+    const std::string& reference = sample.get_reference();
+    std::size_t region_begin = this->parse_size;
+    
+    // The phrase open at an anchor is its trigger string, for every haplotype
+    std::string phrase;
+    if (from == std::string::npos)
+    {
+        this->samples_processed.push_back(sample.id());
         phrase.append(this->w - 1, DOLLAR_PRIME);
-        if (sample.last(this->working_genotype)) { phrase.append(this->w, DOLLAR); }
-        else { phrase.append(1, DOLLAR_SEQUENCE); }
+        phrase.append(1, DOLLAR_SEQUENCE);
+    }
+    else { phrase = reference.substr(from, this->w); }
+    
+    Sample::iterator sample_iterator = (from == std::string::npos) ? Sample::iterator(sample, this->working_genotype) :
+                                       Sample::iterator(sample, this->working_genotype, from + this->w);
+    std::size_t last = (to != std::string::npos) ? to + this->w - 1 : std::string::npos;
+    
+    auto emit = [&](std::string_view view)
+    {
+        size_type id = this->phrase_cache.check_and_add_id(view);
+        if (params.compute_occurrences) { count_occurrence(this->occurrences, id); }
+        out_file.write((char*) (&id), sizeof(size_type)); this->parse_size += 1;
+    };
+    std::string buffer; std::vector<std::size_t> triggers;
+    parse_sample_blocks(sample_iterator, last, phrase, this->w, this->p, this->reference_parse->to_ignore_ts_hash, buffer, triggers, emit);
+    
+    if (to == std::string::npos)
+    {
+        size_type id = last_phrase_id(sample, phrase, this->working_genotype);
+        out_file.write((char*) (&id), sizeof(size_type)); this->parse_size += 1;
+    }
+    
+    this->parsed_samples.push_back({ order, region, region_begin, this->parse_size - region_begin });
+}
 
-        hash_type hash = this->dictionary->check_and_add(phrase);
+void
+vcfbwt::pfp::ParserVCF::parse_segments(const Sample& sample, std::string& phrase)
+{
+    const std::string& reference = sample.get_reference();
+    const std::vector<size_type>& tsp = this->reference_parse->trigger_strings_position;
+    
+    // Segments start after a reference trigger string no variation of this genotype gets close to
+    ChangedIntervals changed;
+    const vcfbwt::Variations& variations = sample.get_variations();
+    sample.for_each_variation([&](std::size_t i, std::size_t var_id)
+    { if (sample.allele(i, this->working_genotype) != 0) { changed.add(variations.pos(var_id), variations.ref_len(var_id)); } });
+    
+    std::size_t segment_length = std::max(PARSING_BLOCK_SIZE, reference.size() / (8 * std::size_t(omp_get_max_threads())));
+    std::vector<std::size_t> anchors;
+    std::size_t last_anchor = anchors_end(tsp, reference.size(), this->w);
+    auto first_after = [&](std::size_t position) { return std::lower_bound(tsp.begin(), tsp.begin() + last_anchor, position) - tsp.begin(); };
+    for (std::size_t i = changed.next_anchor(tsp, first_after(segment_length), last_anchor, this->w); i != std::string::npos;
+         i = changed.next_anchor(tsp, first_after(tsp[i] + segment_length), last_anchor, this->w))
+    { anchors.push_back(tsp[i]); }
+    
+    // Per thread phrase caches
+    if (segment_caches.size() < std::size_t(omp_get_max_threads()))
+    {
+        segment_caches.resize(omp_get_max_threads());
+        for (auto& cache : segment_caches) { cache.init(*this->dictionary, params.phrase_cache_size); }
+    }
+    
+    // Segments are parsed in rounds, the ids of each round are written in sample order
+    std::size_t segments = anchors.size() + 1;
+    std::size_t round_size = 4 * std::size_t(omp_get_max_threads());
+    std::vector<std::vector<size_type>> segment_ids(std::min(round_size, segments));
+    std::string last_open_phrase;
+    
+    for (std::size_t round_start = 0; round_start < segments; round_start += round_size)
+    {
+        std::size_t round_end = std::min(round_start + round_size, segments);
+        
+        #pragma omp parallel for schedule(dynamic)
+        for (std::size_t s = round_start; s < round_end; s++)
+        {
+            PhraseCache& cache = segment_caches[omp_get_thread_num()];
+            std::vector<size_type>& ids = segment_ids[s - round_start]; ids.clear();
+            
+            // The first segment starts with the sample, the others with their anchor trigger string
+            std::string open_phrase = (s == 0) ? phrase : reference.substr(anchors[s - 1], this->w);
+            Sample::iterator sample_iterator = (s == 0) ? Sample::iterator(sample, this->working_genotype) :
+                                               Sample::iterator(sample, this->working_genotype, anchors[s - 1] + this->w);
+            std::size_t last = (s < anchors.size()) ? anchors[s] + this->w - 1 : std::string::npos;
+            
+            std::string buffer; std::vector<std::size_t> triggers;
+            parse_sample_blocks(sample_iterator, last, open_phrase, this->w, this->p, this->reference_parse->to_ignore_ts_hash,
+                                buffer, triggers, [&](std::string_view view) { ids.push_back(cache.check_and_add_id(view)); });
+            
+            if (s + 1 == segments) { last_open_phrase = std::move(open_phrase); }
+        }
         
-        out_file.write((char*) (&hash), sizeof(hash_type));   this->parse_size += 1;
+        for (std::size_t s = round_start; s < round_end; s++)
+        {
+            const std::vector<size_type>& ids = segment_ids[s - round_start];
+            out_file.write((char*) ids.data(), ids.size() * sizeof(size_type)); this->parse_size += ids.size();
+            if (params.compute_occurrences) { for (size_type id : ids) { count_occurrence(this->occurrences, id); } }
+        }
     }
-    else { spdlog::error("A sample doesn't have w dollar prime at the end!"); std::exit(EXIT_FAILURE); }
+    
+    phrase = std::move(last_open_phrase);
 }
 
 void
@@ -324,7 +913,6 @@ vcfbwt::pfp::ParserVCF::close()
     
     if ((tags & MAIN) or (tags & WORKER))
     {
-        vcfbwt::DiskWrites::update(out_file.tellp()); // Disk Stats
         this->out_file.close();
     }
     
@@ -335,131 +923,167 @@ vcfbwt::pfp::ParserVCF::close()
         spdlog::info("Main parser: closing all registered workers");
         for (auto worker : registered_workers) { worker.get().close(); }
         
-        // Occurrences
-        std::vector<size_type> occurrences(this->dictionary->size(), 0);
+        // Phrase cache statistics
+        this->statistics.phrase_cache_hits = 0; this->statistics.phrase_cache_misses = 0;
+        this->statistics.bubble_cache_hits = 0; this->statistics.bubble_cache_misses = 0;
+        auto add_cache_statistics = [&](const ParserVCF& parser)
+        {
+            this->statistics.phrase_cache_hits += parser.phrase_cache.hits;
+            this->statistics.phrase_cache_misses += parser.phrase_cache.misses;
+            for (const auto& cache : parser.segment_caches)
+            { this->statistics.phrase_cache_hits += cache.hits; this->statistics.phrase_cache_misses += cache.misses; }
+            this->statistics.bubble_cache_hits += parser.bubble_cache_hits;
+            this->statistics.bubble_cache_misses += parser.bubble_cache_misses;
+        };
+        add_cache_statistics(*this);
+        for (auto worker : registered_workers) { add_cache_statistics(worker.get()); }
+        spdlog::info("Main parser: phrase cache hits: {} misses: {}", statistics.phrase_cache_hits, statistics.phrase_cache_misses);
+        if (params.use_acceleration)
+        { spdlog::info("Main parser: bubble cache hits: {} misses: {}", statistics.bubble_cache_hits, statistics.bubble_cache_misses); }
         
-        spdlog::info("Main parser: Replacing hash values with ranks in MAIN, WORKERS and reference, wirting .last ans .sai");
+        spdlog::info("Main parser: Replacing phrase ids with ranks in MAIN, WORKERS and reference, wirting .last ans .sai");
         
-        std::string last_file_name = out_file_prefix + EXT::LAST;
-        std::ofstream last_file(last_file_name);
-    
-        std::string sai_file_name = out_file_prefix + EXT::SAI;
-        std::ofstream sai_file(sai_file_name);
+        // Sort once, ranks and phrases are then read without locking
+        if (not this->dictionary->sorted) { this->dictionary->sort(); }
+        const auto& sorted_phrases = this->dictionary->sorted_phrases;
+        const auto& ranks = this->dictionary->ranks;
         
-        std::size_t pos_for_sai = 0;
-    
-        // MAIN mmap file and substitute
-        if (this->parse_size != 0)
+        // Occurrences, from the per parser counts by phrase id
+        std::vector<size_type> occurrences;
+        if (this->params.compute_occurrences)
         {
-            std::error_code error;
-            mio::mmap_sink rw_mmap = mio::make_mmap_sink(tmp_out_file_name, 0, mio::map_entire_file, error);
-            if (error) { spdlog::error(error.message()); std::exit(EXIT_FAILURE); }
-    
-            for (size_type i = 0; i < (rw_mmap.size() / sizeof(hash_type)); i++)
+            std::vector<const std::vector<size_type>*> counts = { &(this->occurrences), &(this->reference_parse->occurrences) };
+            for (auto worker : registered_workers) { counts.push_back(&(worker.get().occurrences)); }
+            
+            occurrences.resize(ranks.size(), 0);
+            #pragma omp parallel for schedule(static)
+            for (std::size_t id = 0; id < ranks.size(); id++)
             {
-                hash_type hash;
-                std::memcpy(&hash, rw_mmap.data() + (i * sizeof(hash_type)), sizeof(hash_type));
-                size_type rank = this->dictionary->hash_to_rank(hash);
-                std::memcpy(rw_mmap.data() + (i * sizeof(size_type)), &rank, sizeof(size_type));
-                occurrences[rank - 1] += 1;
-    
-                const std::string& dict_string = this->dictionary->sorted_entry_at(rank - 1);
-                last_file.put(dict_string[(dict_string.size() - this->params.w) - 1]);
-    
-                if (pos_for_sai == 0) { pos_for_sai = dict_string.size() - 1; } // -1 is for the initial $ of the first word
-                else { pos_for_sai += dict_string.size() - this->params.w; }
-                sai_file.write((char*) &pos_for_sai, IBYTES);
+                size_type occ = 0;
+                for (const auto* count : counts) { if (id < count->size()) { occ += (*count)[id]; } }
+                occurrences[ranks[id] - 1] = occ;
             }
-            rw_mmap.unmap();
-            truncate_file(tmp_out_file_name, this->parse_size * sizeof(size_type));
         }
         
-        // repeat for reference
-        if (not this->reference_parse->parse.empty())
+        // Parses in .last and .sai order: main, reference, workers. The output parse has the reference first.
+        struct ParseSource { const char* ids; std::size_t length, parse_offset; };
+        std::vector<ParseSource> sources;
+        std::vector<mio::mmap_source> tmp_parses; tmp_parses.reserve(registered_workers.size() + 1);
+        
+        auto map_tmp_parse = [&](const ParserVCF& parser) -> const char*
         {
-            for (size_type i = 0; i < this->reference_parse->parse.size(); i++)
+            if (parser.parse_size == 0) { return nullptr; }
+            std::error_code error;
+            tmp_parses.emplace_back(); tmp_parses.back().map(parser.tmp_out_file_name, error);
+            if (error) { spdlog::error(error.message()); std::exit(EXIT_FAILURE); }
+            return tmp_parses.back().data();
+        };
+        
+        std::size_t parse_offset = this->reference_parse->parse.size();
+        if (const char* ids = map_tmp_parse(*this)) { sources.push_back({ ids, this->parse_size, parse_offset }); parse_offset += this->parse_size; }
+        sources.push_back({ (const char*) this->reference_parse->parse.data(), this->reference_parse->parse.size(), 0 });
+        
+        // Reorder the samples parsed by the workers
+        struct Piece { std::size_t order, region, worker, call; const char* ids; std::size_t length; };
+        std::vector<Piece> pieces;
+        for (std::size_t w = 0; w < registered_workers.size(); w++)
+        {
+            const ParserVCF& worker = registered_workers[w].get();
+            const char* ids = map_tmp_parse(worker);
+            for (std::size_t c = 0; c < worker.parsed_samples.size(); c++)
             {
-                hash_type rank = this->dictionary->hash_to_rank(this->reference_parse->parse[i]);
-                this->reference_parse->parse[i] = rank;
-                occurrences[rank - 1] += 1;
-    
-                const std::string& dict_string = this->dictionary->sorted_entry_at(rank - 1);
-                last_file.put(dict_string[(dict_string.size() - this->params.w) - 1]);
-    
-                if (pos_for_sai == 0) { pos_for_sai = dict_string.size() - 1; } // -1 is for the initial $ of the first word
-                else { pos_for_sai += dict_string.size() - this->params.w; }
-                sai_file.write((char*) &pos_for_sai, IBYTES);
+                const ParsedSample& parsed = worker.parsed_samples[c];
+                if (parsed.length != 0) { pieces.push_back({ parsed.order, parsed.region, w, c, ids + (parsed.begin * sizeof(size_type)), parsed.length }); }
             }
         }
+        std::sort(pieces.begin(), pieces.end(), [](const Piece& a, const Piece& b)
+        { return std::tie(a.order, a.region, a.worker, a.call) < std::tie(b.order, b.region, b.worker, b.call); });
+        
+        for (const auto& piece : pieces) { sources.push_back({ piece.ids, piece.length, parse_offset }); parse_offset += piece.length; }
+        std::size_t out_parse_size = parse_offset;
         
-        // repeat for every worker
-        for (auto worker : registered_workers)
+        // Split every parse in chunks, each chunk knows where its elements go in .last and .sai
+        struct Chunk { std::size_t source, begin, end, out_offset, sai_start = 0; };
+        std::vector<Chunk> chunks;
+        std::size_t out_offset = 0;
+        for (std::size_t s = 0; s < sources.size(); s++)
         {
-            if (worker.get().parse_size != 0)
+            for (std::size_t begin = 0; begin < sources[s].length; begin += CLOSING_CHUNK_SIZE)
             {
-                std::error_code error;
-                mio::mmap_sink rw_mmap = mio::make_mmap_sink(worker.get().tmp_out_file_name, 0, mio::map_entire_file, error);
-                if (error) { spdlog::error(error.message()); std::exit(EXIT_FAILURE); }
-    
-                for (size_type i = 0; i < (rw_mmap.size() / sizeof(hash_type)); i++)
-                {
-                    hash_type hash;
-                    std::memcpy(&hash, rw_mmap.data() + (i * sizeof(hash_type)), sizeof(hash_type));
-                    size_type rank = this->dictionary->hash_to_rank(hash);
-                    std::memcpy(rw_mmap.data() + (i * sizeof(size_type)), &rank, sizeof(size_type));
-                    occurrences[rank - 1] += 1;
-    
-                    const std::string& dict_string = this->dictionary->sorted_entry_at(rank - 1);
-                    last_file.put(dict_string[(dict_string.size() - this->params.w) - 1]);
-    
-                    if (pos_for_sai == 0) { pos_for_sai = dict_string.size() - 1; } // -1 is for the initial $ of the first word
-                    else { pos_for_sai += dict_string.size() - this->params.w; }
-                    sai_file.write((char*) &pos_for_sai, IBYTES);
-                }
-                rw_mmap.unmap();
-                truncate_file(worker.get().tmp_out_file_name, worker.get().parse_size * sizeof(size_type));
+                std::size_t end = std::min(begin + CLOSING_CHUNK_SIZE, sources[s].length);
+                chunks.push_back({ s, begin, end, out_offset });
+                out_offset += end - begin;
             }
         }
-    
-        vcfbwt::DiskWrites::update(last_file.tellp());
-        last_file.close();
-    
-        vcfbwt::DiskWrites::update(sai_file.tellp());
-        sai_file.close();
-        
-        // Merging files together
-        spdlog::info("Main parser: concatenating parsings from workers and reference, reference as first");
-        std::ofstream merged(out_file_name, std::ios_base::binary);
         
-        // Reference
-        size_type out_parse_size = 0;
-        out_parse_size += this->reference_parse->parse.size();
-        for (auto& e : this->reference_parse->parse)
+        // Output files are written in place at the chunk offsets
+        auto map_output = [](const std::string& file_name, std::size_t size)
         {
-            size_type out_e = e;
-            merged.write((char*) &out_e, sizeof(size_type));
-        }
-    
-        // Main
-        if ((this->parse_size) != 0)
+            std::ofstream create(file_name, std::ios::binary); create.close();
+            mio::mmap_sink out_mmap;
+            if (size == 0) { return out_mmap; }
+            
+            truncate_file(file_name, size);
+            std::error_code error; out_mmap.map(file_name, error);
+            if (error) { spdlog::error(error.message()); std::exit(EXIT_FAILURE); }
+            vcfbwt::DiskWrites::update(size); // Disk Stats
+            return out_mmap;
+        };
+        
+        mio::mmap_sink merged = map_output(out_file_name, out_parse_size * sizeof(size_type));
+        mio::mmap_sink last_file = map_output(out_file_prefix + EXT::LAST, out_parse_size);
+        mio::mmap_sink sai_file = map_output(out_file_prefix + EXT::SAI, out_parse_size * IBYTES);
+        
+        // Ranks and .last, also the length of each chunk for the .sai prefix sum
+        std::vector<std::size_t> chunk_lengths(chunks.size(), 0);
+        #pragma omp parallel for schedule(dynamic)
+        for (std::size_t c = 0; c < chunks.size(); c++)
         {
-            std::ifstream main_parse(this->tmp_out_file_name);
-            merged << main_parse.rdbuf();
-            out_parse_size += this->parse_size;
+            const Chunk& chunk = chunks[c]; const ParseSource& source = sources[chunk.source];
+            std::size_t length = 0;
+            for (std::size_t i = chunk.begin; i < chunk.end; i++)
+            {
+                size_type id;
+                std::memcpy(&id, source.ids + (i * sizeof(size_type)), sizeof(size_type));
+                size_type rank = ranks[id];
+                std::memcpy(merged.data() + ((source.parse_offset + i) * sizeof(size_type)), &rank, sizeof(size_type));
+                
+                std::string_view dict_string = sorted_phrases[rank - 1].first;
+                last_file[chunk.out_offset + (i - chunk.begin)] = dict_string[(dict_string.size() - this->params.w) - 1];
+                length += dict_string.size() - this->params.w;
+            }
+            chunk_lengths[c] = length;
         }
         
-        // Workers
-        for (auto worker : registered_workers)
+        // The first phrase starts after the initial $, so sai[k] = w - 1 + sum_{j <= k} (|phrase_j| - w)
+        std::size_t sai_start = this->params.w - 1;
+        for (std::size_t c = 0; c < chunks.size(); c++) { chunks[c].sai_start = sai_start; sai_start += chunk_lengths[c]; }
+        
+        #pragma omp parallel for schedule(dynamic)
+        for (std::size_t c = 0; c < chunks.size(); c++)
         {
-            if (worker.get().parse_size != 0)
+            const Chunk& chunk = chunks[c]; const ParseSource& source = sources[chunk.source];
+            std::size_t pos_for_sai = chunk.sai_start;
+            for (std::size_t i = chunk.begin; i < chunk.end; i++)
             {
-                out_parse_size += worker.get().parse_size;
-                std::ifstream worker_parse(worker.get().tmp_out_file_name);
-                merged << worker_parse.rdbuf();
+                size_type rank;
+                std::memcpy(&rank, merged.data() + ((source.parse_offset + i) * sizeof(size_type)), sizeof(size_type));
+                pos_for_sai += sorted_phrases[rank - 1].first.size() - this->params.w;
+                std::memcpy(sai_file.data() + ((chunk.out_offset + (i - chunk.begin)) * IBYTES), &pos_for_sai, IBYTES);
             }
         }
-        vcfbwt::DiskWrites::update(merged.tellp()); // Disk Stats
-        merged.close();
+        
+        // The reference parse is replaced by its ranks
+        #pragma omp parallel for schedule(static)
+        for (std::size_t i = 0; i < this->reference_parse->parse.size(); i++)
+        {
+            size_type rank;
+            std::memcpy(&rank, merged.data() + (i * sizeof(size_type)), sizeof(size_type));
+            this->reference_parse->parse[i] = rank;
+        }
+        
+        merged.unmap(); last_file.unmap(); sai_file.unmap();
+        for (auto& tmp_parse : tmp_parses) { tmp_parse.unmap(); }
         
         this->parse_size = out_parse_size;
         
@@ -468,40 +1092,37 @@ vcfbwt::pfp::ParserVCF::close()
         {
             spdlog::info("Main parser: writing dictionary to disk NOT COMPRESSED");
             std::string dict_file_name = out_file_prefix + EXT::DICT;
-            std::ofstream dict(dict_file_name);
+            AsyncWriter dict(dict_file_name);
         
             for (size_type i = 0; i < this->dictionary->size(); i++)
             {
-                dict.write(this->dictionary->sorted_entry_at(i).c_str(), this->dictionary->sorted_entry_at(i).size());
+                std::string_view phrase = this->dictionary->sorted_entry_at(i);
+                dict.write(phrase.data(), phrase.size());
                 dict.put(ENDOFWORD);
             }
         
             dict.put(ENDOFDICT);
             
-            vcfbwt::DiskWrites::update(dict.tellp()); // Disk Stats
             dict.close();
         }
         
         if (tags & COMPRESSED)
         {
             spdlog::info("Main parser: writing dictionary to disk COMPRESSED");
-            std::ofstream dicz(out_file_prefix + EXT::DICT_COMPRESSED);
-            std::ofstream lengths(out_file_prefix + EXT::DICT_COMPRESSED_LENGTHS);
+            AsyncWriter dicz(out_file_prefix + EXT::DICT_COMPRESSED);
+            AsyncWriter lengths(out_file_prefix + EXT::DICT_COMPRESSED_LENGTHS);
 
             for (size_type i = 0; i < this->dictionary->size(); i++)
             {
                 std::size_t shift = 1; // skip dollar on first phrase
                 if (i != 0) { shift = this->w; }
-                dicz.write(this->dictionary->sorted_entry_at(i).c_str() + shift,
-                           this->dictionary->sorted_entry_at(i).size() - shift);
-                int32_t len = this->dictionary->sorted_entry_at(i).size() - shift;
+                std::string_view phrase = this->dictionary->sorted_entry_at(i);
+                dicz.write(phrase.data() + shift, phrase.size() - shift);
+                int32_t len = phrase.size() - shift;
                 lengths.write((char*) &len, sizeof(int32_t));
             }
     
-            vcfbwt::DiskWrites::update(dicz.tellp()); // Disk Stats
             dicz.close();
-    
-            vcfbwt::DiskWrites::update(lengths.tellp()); // Disk Stats
             lengths.close();
         }
     
@@ -510,10 +1131,9 @@ vcfbwt::pfp::ParserVCF::close()
         {
             spdlog::info("Main parser: writing occurrences to file");
             std::string occ_file_name = out_file_prefix + EXT::OCC;
-            std::ofstream occ(occ_file_name, std::ios::out | std::ios::binary);
+            AsyncWriter occ(occ_file_name);
             occ.write((char*)&occurrences[0], occurrences.size() * sizeof(size_type));
             
-            vcfbwt::DiskWrites::update(occ.tellp()); // Disk Stats
             occ.close();
         }
     }
@@ -537,7 +1157,7 @@ void
 vcfbwt::pfp::ParserFasta::operator()()
 {
     // Open input file with kseq
-    gzFile fp; kseq_t *record;
+    gzFile fp;
     fp = gzopen(this->in_file_path.c_str(), "r");
     if (fp == 0)
     {
@@ -545,66 +1165,116 @@ vcfbwt::pfp::ParserFasta::operator()()
         exit(EXIT_FAILURE);
     }
     
-    std::string phrase;
     spdlog::info("Parsing sequence");
     
-    // Karp Robin Hash Function for sliding window
-    KarpRabinHash kr_hash(this->params.w);
-    
-    // First sequence start with one dollar
-    phrase.append(1, DOLLAR);
+    // Every sequence but the first starts from the phrase closing the previous one, w-1 dollar prime and one dollar seq
+    std::string sequence_start(this->params.w - 1, DOLLAR_PRIME); sequence_start.append(1, DOLLAR_SEQUENCE);
     
-    record = kseq_init(fp);
-    while(kseq_read(record) >= 0)
+    // Records are read by one thread and parsed by the others, the parses are stitched in input order
+    struct Record
+    {
+        std::size_t index = 0;
+        std::string sequence;
+        std::vector<size_type> ids;
+        std::string open_phrase;
+    };
+    
+    std::mutex mutex; std::condition_variable condition;
+    std::deque<Record> to_parse; std::map<std::size_t, Record> parsed;
+    std::size_t in_flight_records = 0, in_flight_bytes = 0, next_record = 0;
+    std::size_t max_in_flight_records = 2 * std::size_t(omp_get_max_threads());
+    bool reading = true, started = false;
+    
+    std::thread reader([&]()
     {
-        std::string sequence_name("<error reading sequence name>"), sequence_comment;
-        if (record->name.s != NULL) { sequence_name = record->name.s; }
-        if (record->comment.s != NULL) { sequence_comment = record->comment.s; }
-        this->sequences_processed.push_back(sequence_name + " " + sequence_comment);
-        spdlog::debug("Parsed:\t{}", sequence_name + " " + sequence_comment);
-        
-        // Previous last phrase
-        if (phrase[0] != DOLLAR and phrase.size() >= this->params.w)
+        kseq_t* record = kseq_init(fp);
+        std::size_t index = 0;
+        while(kseq_read(record) >= 0)
         {
-            // Append w-1 dollar prime, and one dollar seq at the end of each sequence
-            phrase.append(this->params.w - 1, DOLLAR_PRIME);
-            phrase.append(1, DOLLAR_SEQUENCE);
-    
-            hash_type hash = this->dictionary.check_and_add(phrase);
-     
-            out_file.write((char*) (&hash), sizeof(hash_type)); this->parse_size += 1;
-    
-            // Reset phrase
-            phrase.erase();
-            phrase.append(this->params.w - 1, DOLLAR_PRIME);
-            phrase.append(1, DOLLAR_SEQUENCE);
-            kr_hash.reset(); kr_hash.initialize(phrase);
+            std::string sequence_name("<error reading sequence name>"), sequence_comment;
+            if (record->name.s != NULL) { sequence_name = record->name.s; }
+            if (record->comment.s != NULL) { sequence_comment = record->comment.s; }
+            this->sequences_processed.push_back(sequence_name + " " + sequence_comment);
+            spdlog::debug("Parsed:\t{}", sequence_name + " " + sequence_comment);
+            
+            // Bounded number of records and bytes between the reader and the output
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [&]() { return (in_flight_records == 0) or
+                ((in_flight_records < max_in_flight_records) and (in_flight_bytes < FASTA_IN_FLIGHT_BYTES)); });
+            
+            Record to_push; to_push.index = index++; to_push.sequence.assign(record->seq.s, record->seq.l);
+            in_flight_records += 1; in_flight_bytes += record->seq.l;
+            to_parse.push_back(std::move(to_push));
+            lock.unlock(); condition.notify_all();
         }
         
-        for (std::size_t seq_it = 0; seq_it < record->seq.l; seq_it++)
-        {
-            char c = record->seq.s[seq_it];
+        kseq_destroy(record);
+        gzclose(fp);
         
-            phrase.push_back(c);
-            if (phrase.size() == params.w) { kr_hash.initialize(phrase); }
-            else if (phrase.size() > params.w) { kr_hash.update(phrase[phrase.size() - params.w - 1], phrase[phrase.size() - 1]); }
+        std::lock_guard<std::mutex> guard(mutex); reading = false; condition.notify_all();
+    });
+    
+    // First sequence start with one dollar
+    std::string phrase(1, DOLLAR);
+    
+    auto write_id = [&](size_type id) { out_file.write((char*) (&id), sizeof(size_type)); this->parse_size += 1; };
+    
+    #pragma omp parallel
+    {
+        std::string boundary;
+        std::vector<std::size_t> triggers;
         
-            if ((phrase.size() > this->params.w) and ((kr_hash.get_hash() % this->params.p) == 0))
+        while (true)
+        {
+            Record record;
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [&]() { return (not to_parse.empty()) or (not reading); });
+            if (to_parse.empty()) { break; }
+            record = std::move(to_parse.front()); to_parse.pop_front();
+            
+            // Until the first trigger string the sequences continue the first phrase, they are parsed in order
+            condition.wait(lock, [&]() { return started or (next_record == record.index); });
+            if (not started)
             {
-                std::string_view ts(&(phrase[phrase.size() - params.w]), params.w);
-                hash_type ts_hash = KarpRabinHash::string_hash(ts);
+                cut_record_phrases(phrase, record.sequence.data(), record.sequence.size(), params.w, params.p,
+                                   boundary, triggers, [&](std::string_view view) { write_id(this->dictionary.check_and_add_id(view)); });
+                started = (phrase[0] != DOLLAR);
+                
+                in_flight_records -= 1; in_flight_bytes -= record.sequence.size(); next_record += 1;
+                lock.unlock(); condition.notify_all();
+                continue;
+            }
+            lock.unlock();
             
-                hash_type hash = this->dictionary.check_and_add(phrase);
-    
-                out_file.write((char*) (&hash), sizeof(hash_type)); this->parse_size += 1;
+            record.open_phrase = sequence_start;
+            cut_record_phrases(record.open_phrase, record.sequence.data(), record.sequence.size(), params.w, params.p,
+                               boundary, triggers, [&](std::string_view view)
+            {
+                record.ids.push_back(this->dictionary.check_and_add_id(view));
+            });
+            
+            // Stitch all the records ready in input order
+            lock.lock();
+            parsed.emplace(record.index, std::move(record));
+            for (auto it = parsed.find(next_record); it != parsed.end(); it = parsed.find(next_record))
+            {
+                Record& ready = it->second;
+                
+                // Previous last phrase
+                phrase.append(sequence_start); write_id(this->dictionary.check_and_add_id(phrase));
                 
-                phrase.erase(phrase.begin(), phrase.end() - this->params.w); // Keep the last w chars
+                for (size_type id : ready.ids) { write_id(id); }
+                phrase = std::move(ready.open_phrase);
                 
-                kr_hash.reset(); kr_hash.initialize(phrase);
+                in_flight_records -= 1; in_flight_bytes -= ready.sequence.size();
+                parsed.erase(it); next_record += 1;
             }
+            lock.unlock(); condition.notify_all();
         }
     }
     
+    reader.join();
+    
     // Last phrase
     if (phrase.size() > this->params.w)
     {
@@ -614,35 +1284,30 @@ vcfbwt::pfp::ParserFasta::operator()()
         // Append w dollar at the end
         phrase.append(this->params.w, DOLLAR);
         
-        hash_type hash = this->dictionary.check_and_add(phrase);
+        size_type id = this->dictionary.check_and_add_id(phrase);
         
-        out_file.write((char*) (&hash), sizeof(hash_type)); this->parse_size += 1;
+        out_file.write((char*) (&id), sizeof(size_type)); this->parse_size += 1;
     }
     else { spdlog::error("Missing w DOLLAR at the end!"); std::exit(EXIT_FAILURE); }
-    
-    kseq_destroy(record);
-    gzclose(fp);
 }
 
-
 void
 vcfbwt::pfp::ParserFasta::close()
 {
     if (closed) return; closed = true;
     
-    vcfbwt::DiskWrites::update(out_file.tellp()); // Disk Stats
     this->out_file.close();
     
     // Occurrences
     std::vector<size_type> occurrences(this->dictionary.size(), 0);
     
-    spdlog::info("Main parser: Replacing hash values with ranks, writing .last and .sai");
+    spdlog::info("Main parser: Replacing phrase ids with ranks, writing .last and .sai");
     
     std::string last_file_name = out_file_prefix + EXT::LAST;
-    std::ofstream last_file(last_file_name);
+    AsyncWriter last_file(last_file_name);
     
     std::string sai_file_name = out_file_prefix + EXT::SAI;
-    std::ofstream sai_file(sai_file_name);
+    AsyncWriter sai_file(sai_file_name);
     
     std::size_t pos_for_sai = 0;
     
@@ -653,15 +1318,15 @@ vcfbwt::pfp::ParserFasta::close()
         mio::mmap_sink rw_mmap = mio::make_mmap_sink(out_file_name, 0, mio::map_entire_file, error);
         if (error) { spdlog::error(error.message()); std::exit(EXIT_FAILURE); }
         
-        for (size_type i = 0; i < (rw_mmap.size() / sizeof(hash_type)); i++)
+        for (size_type i = 0; i < (rw_mmap.size() / sizeof(size_type)); i++)
         {
-            hash_type hash;
-            std::memcpy(&hash, rw_mmap.data() + (i * sizeof(hash_type)), sizeof(hash_type));
-            size_type rank = this->dictionary.hash_to_rank(hash);
+            size_type id;
+            std::memcpy(&id, rw_mmap.data() + (i * sizeof(size_type)), sizeof(size_type));
+            size_type rank = this->dictionary.id_to_rank(id);
             std::memcpy(rw_mmap.data() + (i * sizeof(size_type)), &rank, sizeof(size_type));
             occurrences[rank - 1] += 1;
     
-            const std::string& dict_string = this->dictionary.sorted_entry_at(rank - 1);
+            std::string_view dict_string = this->dictionary.sorted_entry_at(rank - 1);
             last_file.put(dict_string[(dict_string.size() - this->params.w) - 1]);
     
             if (pos_for_sai == 0) { pos_for_sai = dict_string.size() - 1; } // -1 is for the initial $ of the first word
@@ -669,51 +1334,44 @@ vcfbwt::pfp::ParserFasta::close()
             sai_file.write((char*) &pos_for_sai, IBYTES);
         }
         rw_mmap.unmap();
-        truncate_file(out_file_name, this->parse_size * sizeof(size_type));
     }
     
-    vcfbwt::DiskWrites::update(last_file.tellp());
     last_file.close();
-    
-    vcfbwt::DiskWrites::update(sai_file.tellp());
     sai_file.close();
     
     // Print dicitionary on disk
     spdlog::info("Main parser: writing dictionary on disk NOT COMPRESSED");
     std::string dict_file_name = out_file_prefix + EXT::DICT;
-    std::ofstream dict(dict_file_name);
+    AsyncWriter dict(dict_file_name);
     
     for (size_type i = 0; i < this->dictionary.size(); i++)
     {
-        dict.write(this->dictionary.sorted_entry_at(i).c_str(), this->dictionary.sorted_entry_at(i).size());
+        std::string_view phrase = this->dictionary.sorted_entry_at(i);
+        dict.write(phrase.data(), phrase.size());
         dict.put(ENDOFWORD);
     }
     
     dict.put(ENDOFDICT);
     
-    vcfbwt::DiskWrites::update(dict.tellp()); // Disk Stats
     dict.close();
     
     if (this->params.compress_dictionary)
     {
         spdlog::info("Main parser: writing dictionary on disk COMPRESSED");
-        std::ofstream dicz(out_file_prefix + EXT::DICT_COMPRESSED);
-        std::ofstream lengths(out_file_prefix + EXT::DICT_COMPRESSED_LENGTHS);
+        AsyncWriter dicz(out_file_prefix + EXT::DICT_COMPRESSED);
+        AsyncWriter lengths(out_file_prefix + EXT::DICT_COMPRESSED_LENGTHS);
 
         for (size_type i = 0; i < this->dictionary.size(); i++)
         {
             std::size_t shift = 1; // skip dollar on first phrase
             if (i != 0) { shift = this->w; }
-            dicz.write(this->dictionary.sorted_entry_at(i).c_str() + shift,
-                       this->dictionary.sorted_entry_at(i).size() - shift);
-            int32_t len = this->dictionary.sorted_entry_at(i).size() - shift;
+            std::string_view phrase = this->dictionary.sorted_entry_at(i);
+            dicz.write(phrase.data() + shift, phrase.size() - shift);
+            int32_t len = phrase.size() - shift;
             lengths.write((char*) &len, sizeof(int32_t));
         }
         
-        vcfbwt::DiskWrites::update(dicz.tellp()); // Disk Stats
         dicz.close();
-        
-        vcfbwt::DiskWrites::update(lengths.tellp()); // Disk Stats
         lengths.close();
     }
     
@@ -722,10 +1380,9 @@ vcfbwt::pfp::ParserFasta::close()
     {
         spdlog::info("Main parser: writing occurrences to file");
         std::string occ_file_name = out_file_prefix + EXT::OCC;
-        std::ofstream occ(occ_file_name, std::ios::out | std::ios::binary);
+        AsyncWriter occ(occ_file_name);
         occ.write((char*)&occurrences[0], occurrences.size() * sizeof(size_type));
         
-        vcfbwt::DiskWrites::update(occ.tellp()); // Disk Stats
         occ.close();
     }
 
@@ -748,44 +1405,71 @@ vcfbwt::pfp::ParserText::init(const Params& params, const std::string& prefix)
 void
 vcfbwt::pfp::ParserText::operator()()
 {
-    // Open input file with kseq
-    gzFile fp;
-    fp = gzopen(this->in_file_path.c_str(), "r");
-    if (fp == 0)
-    {
-        spdlog::error("Failed to open input file {}", in_file_path);
-        exit(EXIT_FAILURE);
-    }
-    
     std::string phrase;
     spdlog::info("Parsing {}", in_file_path);
     
-    // Karp Robin Hash Function for sliding window
-    KarpRabinHash kr_hash(this->params.w);
-    
     // First sequence start with one dollar
     phrase.append(1, DOLLAR);
     
-    char c;
-    while(gzread(fp, &c, 1) > 0)
+    std::vector<std::size_t> triggers;
+    auto emit = [&](std::string_view view)
+    {
+        size_type id = this->dictionary.check_and_add_id(view);
+        
+        out_file.write((char*) (&id), sizeof(size_type)); this->parse_size += 1;
+    };
+    
+    std::ifstream in_stream(this->in_file_path);
+    if (not in_stream.is_open()) { spdlog::error("Failed to open input file {}", in_file_path); exit(EXIT_FAILURE); }
+    bool gzipped = is_gzipped(in_stream);
+    in_stream.close();
+    
+    if (not gzipped)
     {
-        phrase.push_back(c);
-        if (phrase.size() == params.w) { kr_hash.initialize(phrase); }
-        else if (phrase.size() > params.w) { kr_hash.update(phrase[phrase.size() - params.w - 1], phrase[phrase.size() - 1]); }
+        // Uncompressed input, phrases are taken directly from the mapped file
+        std::error_code error;
+        mio::mmap_source in_text; in_text.map(this->in_file_path, error);
+        if (error) { spdlog::error("Failed to map input file {}: {}", in_file_path, error.message()); exit(EXIT_FAILURE); }
         
-        if ((phrase.size() > this->params.w) and ((kr_hash.get_hash() % this->params.p) == 0))
+        // Blocks are parsed in parallel, the ids are written in text order
+        std::size_t last_trigger = parallel_cut_phrases(in_text.data(), in_text.size(), params.w, params.p, phrase,
+        [](std::size_t) { return true; },
+        [&](std::string_view view) { return this->dictionary.check_and_add_id(view); },
+        [&](const std::vector<size_type>& ids, const std::vector<std::size_t>&)
         {
-            std::string_view ts(&(phrase[phrase.size() - params.w]), params.w);
-            hash_type ts_hash = KarpRabinHash::string_hash(ts);
-            
-            hash_type hash = this->dictionary.check_and_add(phrase);
-            
-            out_file.write((char*) (&hash), sizeof(hash_type)); this->parse_size += 1;
+            out_file.write((char*) ids.data(), ids.size() * sizeof(size_type)); this->parse_size += ids.size();
+        });
+        
+        if (last_trigger == std::string::npos) { phrase.append(in_text.data(), in_text.size()); }
+        else { phrase.assign(in_text.data() + last_trigger + 1 - params.w, in_text.size() - (last_trigger + 1 - params.w)); }
+    }
+    else
+    {
+        gzFile fp;
+        fp = gzopen(this->in_file_path.c_str(), "r");
+        if (fp == 0)
+        {
+            spdlog::error("Failed to open input file {}", in_file_path);
+            exit(EXIT_FAILURE);
+        }
+        
+        // Read the input in blocks, each block is preceded by the last w - 1 chars read
+        std::string buffer(PARSING_BLOCK_SIZE + this->params.w, 0);
+        std::size_t context = 0;
+        int bytes_read = 0;
+        while ((bytes_read = gzread(fp, &(buffer[context]), PARSING_BLOCK_SIZE)) > 0)
+        {
+            std::size_t buffer_size = context + bytes_read;
             
-            phrase.erase(phrase.begin(), phrase.end() - this->params.w); // Keep the last w chars
+            triggers.clear();
+            find_trigger_strings(buffer.data(), buffer_size, params.w, params.p, triggers);
+            cut_phrases(phrase, buffer.data(), context, buffer_size, params.w, triggers, emit);
             
-            kr_hash.reset(); kr_hash.initialize(phrase);
+            context = std::min<std::size_t>(this->params.w - 1, buffer_size);
+            std::memmove(&(buffer[0]), &(buffer[buffer_size - context]), context);
         }
+        
+        gzclose(fp);
     }
     
     // Last phrase
@@ -794,13 +1478,11 @@ vcfbwt::pfp::ParserText::operator()()
         // Append w dollar at the end
         phrase.append(this->params.w, DOLLAR);
         
-        hash_type hash = this->dictionary.check_and_add(phrase);
+        size_type id = this->dictionary.check_and_add_id(phrase);
         
-        out_file.write((char*) (&hash), sizeof(hash_type)); this->parse_size += 1;
+        out_file.write((char*) (&id), sizeof(size_type)); this->parse_size += 1;
     }
     else { spdlog::error("A sequence doesn't have w DOLLAR at the end!"); std::exit(EXIT_FAILURE); }
-    
-    gzclose(fp);
 }
 
 
@@ -809,19 +1491,18 @@ vcfbwt::pfp::ParserText::close()
 {
     if (closed) return; closed = true;
     
-    vcfbwt::DiskWrites::update(out_file.tellp()); // Disk Stats
     this->out_file.close();
     
     // Occurrences
     std::vector<size_type> occurrences(this->dictionary.size(), 0);
     
-    spdlog::info("Main parser: Replacing hash values with ranks, writing .last and .sai");
+    spdlog::info("Main parser: Replacing phrase ids with ranks, writing .last and .sai");
   
     std::string last_file_name = out_file_prefix + EXT::LAST;
-    std::ofstream last_file(last_file_name);
+    AsyncWriter last_file(last_file_name);
     
     std::string sai_file_name = out_file_prefix + EXT::SAI;
-    std::ofstream sai_file(sai_file_name);
+    AsyncWriter sai_file(sai_file_name);
     
     std::size_t pos_for_sai = 0;
     
@@ -832,15 +1513,15 @@ vcfbwt::pfp::ParserText::close()
         mio::mmap_sink rw_mmap = mio::make_mmap_sink(out_file_name, 0, mio::map_entire_file, error);
         if (error) { spdlog::error(error.message()); std::exit(EXIT_FAILURE); }
         
-        for (size_type i = 0; i < (rw_mmap.size() / sizeof(hash_type)); i++)
+        for (size_type i = 0; i < (rw_mmap.size() / sizeof(size_type)); i++)
         {
-            hash_type hash;
-            std::memcpy(&hash, rw_mmap.data() + (i * sizeof(hash_type)), sizeof(hash_type));
-            size_type rank = this->dictionary.hash_to_rank(hash);
+            size_type id;
+            std::memcpy(&id, rw_mmap.data() + (i * sizeof(size_type)), sizeof(size_type));
+            size_type rank = this->dictionary.id_to_rank(id);
             std::memcpy(rw_mmap.data() + (i * sizeof(size_type)), &rank, sizeof(size_type));
             occurrences[rank - 1] += 1;
             
-            const std::string& dict_string = this->dictionary.sorted_entry_at(rank - 1);
+            std::string_view dict_string = this->dictionary.sorted_entry_at(rank - 1);
             last_file.put(dict_string[(dict_string.size() - this->params.w) - 1]);
     
             if (pos_for_sai == 0) { pos_for_sai = dict_string.size() - 1; } // -1 is for the initial $ of the first word
@@ -848,51 +1529,44 @@ vcfbwt::pfp::ParserText::close()
             sai_file.write((char*) &pos_for_sai, IBYTES);
         }
         rw_mmap.unmap();
-        truncate_file(out_file_name, this->parse_size * sizeof(size_type));
     }
     
-    vcfbwt::DiskWrites::update(last_file.tellp());
     last_file.close();
-    
-    vcfbwt::DiskWrites::update(sai_file.tellp());
     sai_file.close();
     
     // Print dicitionary on disk
     spdlog::info("Main parser: writing dictionary on disk NOT COMPRESSED");
     std::string dict_file_name = out_file_prefix + EXT::DICT;
-    std::ofstream dict(dict_file_name);
+    AsyncWriter dict(dict_file_name);
     
     for (size_type i = 0; i < this->dictionary.size(); i++)
     {
-        dict.write(this->dictionary.sorted_entry_at(i).c_str(), this->dictionary.sorted_entry_at(i).size());
+        std::string_view phrase = this->dictionary.sorted_entry_at(i);
+        dict.write(phrase.data(), phrase.size());
         dict.put(ENDOFWORD);
     }
     
     dict.put(ENDOFDICT);
     
-    vcfbwt::DiskWrites::update(dict.tellp()); // Disk Stats
     dict.close();
     
     if (this->params.compress_dictionary)
     {
         spdlog::info("Main parser: writing dictionary on disk COMPRESSED");
-        std::ofstream dicz(out_file_prefix + EXT::DICT_COMPRESSED);
-        std::ofstream lengths(out_file_prefix + EXT::DICT_COMPRESSED_LENGTHS);
+        AsyncWriter dicz(out_file_prefix + EXT::DICT_COMPRESSED);
+        AsyncWriter lengths(out_file_prefix + EXT::DICT_COMPRESSED_LENGTHS);
         
         for (size_type i = 0; i < this->dictionary.size(); i++)
         {
             std::size_t shift = 1; // skip dollar on first phrase
             if (i != 0) { shift = this->w; }
-            dicz.write(this->dictionary.sorted_entry_at(i).c_str() + shift,
-                       this->dictionary.sorted_entry_at(i).size() - shift);
-            int32_t len = this->dictionary.sorted_entry_at(i).size() - shift;
+            std::string_view phrase = this->dictionary.sorted_entry_at(i);
+            dicz.write(phrase.data() + shift, phrase.size() - shift);
+            int32_t len = phrase.size() - shift;
             lengths.write((char*) &len, sizeof(int32_t));
         }
         
-        vcfbwt::DiskWrites::update(dicz.tellp()); // Disk Stats
         dicz.close();
-        
-        vcfbwt::DiskWrites::update(lengths.tellp()); // Disk Stats
         lengths.close();
     }
     
@@ -901,10 +1575,9 @@ vcfbwt::pfp::ParserText::close()
     {
         spdlog::info("Main parser: writing occurrences to file");
         std::string occ_file_name = out_file_prefix + EXT::OCC;
-        std::ofstream occ(occ_file_name, std::ios::out | std::ios::binary);
+        AsyncWriter occ(occ_file_name);
         occ.write((char*)&occurrences[0], occurrences.size() * sizeof(size_type));
         
-        vcfbwt::DiskWrites::update(occ.tellp()); // Disk Stats
         occ.close();
     }
     
@@ -996,19 +1669,7 @@ vcfbwt::pfp::ParserUtils::merge(std::string left_prefix, std::string right_prefi
     
     // Sort the Dictionary
     spdlog::info("Sorting merged dictionary");
-    std::vector<std::pair<std::string, hash_type>> entries;
-    for (auto& entry : dictionary.hash_string_map)
-    {
-        entries.push_back(std::make_pair(entry.second.phrase, entry.first));
-    }
-    std::sort(entries.begin(), entries.end());
-    
-    // Insert in hashmap
-    std::unordered_map<hash_type, hash_type> hash_to_ranks;
-    for (hash_type i = 0; i < entries.size(); i++)
-    {
-        hash_to_ranks.insert(std::make_pair(entries[i].second, i + 1)); // 1 based
-    }
+    dictionary.sort();
     
     // Merge parsings
     spdlog::info("Creating output parse");
@@ -1022,9 +1683,8 @@ vcfbwt::pfp::ParserUtils::merge(std::string left_prefix, std::string right_prefi
         hash_type hash;
         std::memcpy(&hash, rl_mmap.data() + (i * sizeof(hash_type)), sizeof(hash_type));
         
-        auto it = hash_to_ranks.find(hash);
-        if (it != hash_to_ranks.end()) { out_parse.write((char*) &(it->second), sizeof(hash_type)); }
-        else { spdlog::error("Something wrong happend"); std::exit(EXIT_FAILURE); }
+        hash_type rank = dictionary.hash_to_rank(hash);
+        out_parse.write((char*) &rank, sizeof(hash_type));
     }
     rl_mmap.unmap();
     
@@ -1036,9 +1696,8 @@ vcfbwt::pfp::ParserUtils::merge(std::string left_prefix, std::string right_prefi
         hash_type hash;
         std::memcpy(&hash, rr_mmap.data() + (i * sizeof(hash_type)), sizeof(hash_type));
         
-        auto it = hash_to_ranks.find(hash);
-        if (it != hash_to_ranks.end()) { out_parse.write((char*) &(it->second), sizeof(hash_type)); }
-        else { spdlog::error("Something wrong happend"); std::exit(EXIT_FAILURE); }
+        hash_type rank = dictionary.hash_to_rank(hash);
+        out_parse.write((char*) &rank, sizeof(hash_type));
     }
     rr_mmap.unmap();
     out_parse.close();
@@ -1048,9 +1707,9 @@ vcfbwt::pfp::ParserUtils::merge(std::string left_prefix, std::string right_prefi
     std::string dict_file_name = out_prefix + EXT::DICT;
     std::ofstream dict(dict_file_name);
     
-    for (auto& entry : entries)
+    for (auto& entry : dictionary.sorted_phrases)
     {
-        dict.write(entry.first.c_str(), entry.first.size());
+        dict.write(entry.first.data(), entry.first.size());
         dict.put(ENDOFWORD);
     }
     
@@ -40,13 +40,14 @@ vcfbwt::KarpRabinHash::initialize(const std::string& window)
     
     constant_to_n_minus_one_mod = modular_pow(constant, window_length - 1, prime);
     
+    // Horner's rule, same value as summing c_i * constant^(n - 1 - i) mod prime
     assert(window.size() == this->window_length);
+    hash_type window_hash = 0;
     for (hash_type i = 0; i < this->window_length; i++)
     {
-        char_type c = window[window.size() - 1 - i];
-        hash_value += c * modular_pow(constant, i, prime);
-        hash_value = hash_value % prime;
+        window_hash = ((window_hash * constant) + char_type(window[i])) % prime;
     }
+    hash_value = (hash_value + window_hash) % prime;
 }
 
 void
@@ -64,13 +65,9 @@ vcfbwt::hash_type
 vcfbwt::KarpRabinHash::string_hash(const std::string_view& s)
 {
     hash_type result = 0;
-    hash_type constant_to_n_minus_one_mod = modular_pow(kr_constant, s.size() - 1, kr_prime);
-    
     for (hash_type i = 0; i < s.size(); i++)
     {
-        char_type c = s[s.size() - 1 - i];
-        result += c * modular_pow(kr_constant, i, kr_prime);
-        result = result % kr_prime;
+        result = ((result * kr_constant) + char_type(s[i])) % kr_prime;
     }
     
     return result;
@@ -78,6 +75,159 @@ vcfbwt::KarpRabinHash::string_hash(const std::string_view& s)
 
 //------------------------------------------------------------------------------
 
+#if defined(__GNUC__) and (defined(__x86_64__) or defined(__i386__))
+#define PFP_AVX2_SCANNER
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+void
+find_trigger_strings_scalar(const char* text, std::size_t size, std::size_t w, std::size_t p, std::vector<std::size_t>& triggers)
+{
+    if (size < w) { return; }
+    
+    vcfbwt::with_kr_window(w, [&](auto kr_hash)
+    {
+        kr_hash.initialize(text);
+        if ((kr_hash.get_hash() % p) == 0) { triggers.push_back(w - 1); }
+        
+        for (std::size_t i = w; i < size; i++)
+        {
+            kr_hash.update(text[i - w], text[i]);
+            if ((kr_hash.get_hash() % p) == 0) { triggers.push_back(i); }
+        }
+    });
+}
+
+#ifdef PFP_AVX2_SCANNER
+
+// Reduces x in (-m * 2^9, m * 2^9) to [0, m), exact as long as x and m are integers below 2^41
+__attribute__((target("avx2")))
+inline __m256d
+reduce_avx2(__m256d x, __m256d m, __m256d m_inv)
+{
+    __m256d q = _mm256_floor_pd(_mm256_mul_pd(x, m_inv));
+    __m256d r = _mm256_sub_pd(x, _mm256_mul_pd(q, m));
+    r = _mm256_add_pd(r, _mm256_and_pd(_mm256_cmp_pd(r, _mm256_setzero_pd(), _CMP_LT_OQ), m));
+    r = _mm256_sub_pd(r, _mm256_and_pd(_mm256_cmp_pd(r, m, _CMP_GE_OQ), m));
+    return r;
+}
+
+// The windows are split in 16 contiguous lanes rolled in parallel, 4 independent vectors of 4 lanes hide the
+// latency of the modular reduction. All values stay below 2^41 so the modular arithmetic is exact in double
+// precision and the hashes are the same as the scalar ones.
+__attribute__((target("avx2")))
+void
+find_trigger_strings_avx2(const char* text, std::size_t size, std::size_t w, std::size_t p, std::vector<std::size_t>& triggers)
+{
+    constexpr std::size_t lanes = 16;
+    constexpr std::size_t vectors = lanes / 4;
+    
+    std::size_t windows = (size >= w) ? (size - w + 1) : 0;
+    std::size_t lane_length = windows / lanes;
+    if ((lane_length < 16 * w) or (size >= std::size_t(std::numeric_limits<int32_t>::max())))
+    { find_trigger_strings_scalar(text, size, w, p, triggers); return; }
+    
+    const vcfbwt::hash_type prime = vcfbwt::KarpRabinHash::kr_prime;
+    const vcfbwt::hash_type constant = vcfbwt::KarpRabinHash::kr_constant;
+    
+    // constant^w mod prime, removes the outgoing char after the window has been shifted
+    vcfbwt::hash_type constant_to_n = 1;
+    for (std::size_t i = 0; i < w; i++) { constant_to_n = (constant_to_n * constant) % prime; }
+    
+    vcfbwt::KarpRabinWindow<> lane_hash(w);
+    alignas(32) double hashes[lanes];
+    alignas(32) int32_t offsets[lanes];
+    std::vector<std::size_t> lane_triggers[lanes];
+    for (std::size_t k = 0; k < lanes; k++)
+    {
+        offsets[k] = int32_t(k * lane_length);
+        lane_hash.initialize(text + (k * lane_length));
+        hashes[k] = double(lane_hash.get_hash());
+        if ((lane_hash.get_hash() % p) == 0) { lane_triggers[k].push_back(w - 1 + (k * lane_length)); }
+    }
+    
+    const __m256d v_prime = _mm256_set1_pd(double(prime));
+    const __m256d v_prime_inv = _mm256_set1_pd(1.0 / double(prime));
+    const __m256d v_mod = _mm256_set1_pd(double(p));
+    const __m256d v_mod_inv = _mm256_set1_pd(1.0 / double(p));
+    const __m256d v_constant = _mm256_set1_pd(double(constant));
+    const __m256d v_constant_to_n = _mm256_set1_pd(double(constant_to_n));
+    const __m256d v_zero = _mm256_setzero_pd();
+    const __m256i v_char_mask = _mm256_set1_epi32(0xFF);
+    const __m256i v_offsets[2] = { _mm256_load_si256((const __m256i*) offsets), _mm256_load_si256((const __m256i*) (offsets + 8)) };
+    
+    __m256d v_hash[vectors];
+    for (std::size_t v = 0; v < vectors; v++) { v_hash[v] = _mm256_load_pd(hashes + (4 * v)); }
+    
+    // The gathers read 4 bytes per lane, stop before reading past the end of the text
+    std::size_t vector_steps = std::min(lane_length, size - ((lanes - 1) * lane_length) - w - 3);
+    
+    for (std::size_t j = 1; j < vector_steps; j++)
+    {
+        __m256d v_out[vectors], v_in[vectors];
+        for (std::size_t g = 0; g < 2; g++)
+        {
+            __m256i chars_out = _mm256_and_si256(_mm256_i32gather_epi32((const int*) (text + j - 1), v_offsets[g], 1), v_char_mask);
+            __m256i chars_in = _mm256_and_si256(_mm256_i32gather_epi32((const int*) (text + j + w - 1), v_offsets[g], 1), v_char_mask);
+            v_out[2 * g] = _mm256_cvtepi32_pd(_mm256_castsi256_si128(chars_out));
+            v_out[2 * g + 1] = _mm256_cvtepi32_pd(_mm256_extracti128_si256(chars_out, 1));
+            v_in[2 * g] = _mm256_cvtepi32_pd(_mm256_castsi256_si128(chars_in));
+            v_in[2 * g + 1] = _mm256_cvtepi32_pd(_mm256_extracti128_si256(chars_in, 1));
+        }
+        
+        int mask = 0;
+        for (std::size_t v = 0; v < vectors; v++)
+        {
+            __m256d x = _mm256_add_pd(_mm256_mul_pd(v_hash[v], v_constant), v_in[v]);
+            x = _mm256_sub_pd(x, _mm256_mul_pd(v_out[v], v_constant_to_n));
+            v_hash[v] = reduce_avx2(x, v_prime, v_prime_inv);
+            mask |= _mm256_movemask_pd(_mm256_cmp_pd(reduce_avx2(v_hash[v], v_mod, v_mod_inv), v_zero, _CMP_EQ_OQ)) << (4 * v);
+        }
+        
+        if (mask != 0)
+        {
+            for (std::size_t k = 0; k < lanes; k++)
+            { if (mask & (1 << k)) { lane_triggers[k].push_back(w - 1 + (k * lane_length) + j); } }
+        }
+    }
+    
+    // Finish each lane with the scalar rolling hash, the last lane also takes the remaining windows
+    for (std::size_t k = 0; k < lanes; k++)
+    {
+        std::size_t lane_begin = k * lane_length;
+        std::size_t lane_end = (k == lanes - 1) ? windows : lane_begin + lane_length;
+        std::size_t j = lane_begin + std::max<std::size_t>(vector_steps, 1) - 1;
+        
+        lane_hash.initialize(text + j);
+        for (j = j + 1; j < lane_end; j++)
+        {
+            lane_hash.update(text[j - 1], text[j + w - 1]);
+            if ((lane_hash.get_hash() % p) == 0) { lane_triggers[k].push_back(j + w - 1); }
+        }
+        
+        triggers.insert(triggers.end(), lane_triggers[k].begin(), lane_triggers[k].end());
+    }
+}
+
+#endif
+
+} // end anonymous namespace
+
+void
+vcfbwt::find_trigger_strings(const char* text, std::size_t size, std::size_t w, std::size_t p, std::vector<std::size_t>& triggers)
+{
+#ifdef PFP_AVX2_SCANNER
+    static const bool use_avx2 = __builtin_cpu_supports("avx2");
+    if (use_avx2) { find_trigger_strings_avx2(text, size, w, p, triggers); return; }
+#endif
+    find_trigger_strings_scalar(text, size, w, p, triggers);
+}
+
+//------------------------------------------------------------------------------
+
 const std::string vcfbwt::TempFile::DEFAULT_TEMP_DIR = ".";
 std::string vcfbwt::TempFile::temp_dir = vcfbwt::TempFile::DEFAULT_TEMP_DIR;
 
@@ -187,13 +337,209 @@ void vcfbwt::DiskWrites::update(std::size_t num_of_bytes)
     writes_counter.bytes_wrote += num_of_bytes;
 }
 
-bool
-vcfbwt::ref_smaller(
-std::pair<std::reference_wrapper<std::string>, vcfbwt::hash_type> a,
-std::pair<std::reference_wrapper<std::string>, vcfbwt::hash_type> b)
+//------------------------------------------------------------------------------
+
+namespace
 {
-    return (a.first.get() < b.first.get());
+
+using string_entry = std::pair<std::string_view, vcfbwt::hash_type>;
+
+constexpr std::size_t insertion_sort_threshold = 16;
+constexpr std::size_t task_threshold = 1 << 14;
+
+// -1 past the end, so a string comes before its extensions
+inline int
+char_at(const string_entry& s, std::size_t depth)
+{
+    return (depth < s.first.size()) ? (unsigned char) s.first[depth] : -1;
 }
 
+// All strings share the first depth chars
+void
+insertion_sort(string_entry* strings, std::size_t n, std::size_t depth)
+{
+    for (std::size_t i = 1; i < n; i++)
+    {
+        string_entry s = strings[i];
+        std::string_view suffix = s.first.substr(depth);
+        
+        std::size_t j = i;
+        while ((j > 0) and (suffix < strings[j - 1].first.substr(depth))) { strings[j] = strings[j - 1]; j--; }
+        strings[j] = s;
+    }
+}
+
+void multikey_quicksort(string_entry* strings, std::size_t n, std::size_t depth);
+
+void
+sort_partition(string_entry* strings, std::size_t n, std::size_t depth)
+{
+    if (n > task_threshold)
+    {
+        #pragma omp task default(none) firstprivate(strings, n, depth)
+        multikey_quicksort(strings, n, depth);
+    }
+    else { multikey_quicksort(strings, n, depth); }
+}
+
+// Bentley-Sedgewick multikey quicksort, all strings share the first depth chars which are never compared again
+void
+multikey_quicksort(string_entry* strings, std::size_t n, std::size_t depth)
+{
+    while (n > insertion_sort_threshold)
+    {
+        // Median of three pivot
+        int a = char_at(strings[0], depth), b = char_at(strings[n / 2], depth), c = char_at(strings[n - 1], depth);
+        int pivot = std::max(std::min(a, b), std::min(std::max(a, b), c));
+        
+        // Three way partition on the char at depth
+        std::size_t lt = 0, i = 0, gt = n;
+        while (i < gt)
+        {
+            int ch = char_at(strings[i], depth);
+            if (ch < pivot) { std::swap(strings[lt++], strings[i++]); }
+            else if (ch > pivot) { std::swap(strings[i], strings[--gt]); }
+            else { i++; }
+        }
+        
+        sort_partition(strings, lt, depth);
+        sort_partition(strings + gt, n - gt, depth);
+        
+        // The middle partition goes one char deeper, unless all its strings ended
+        if (pivot == -1) { return; }
+        strings += lt; n = gt - lt; depth++;
+    }
+    insertion_sort(strings, n, depth);
+}
+
+} // end anonymous namespace
+
+void
+vcfbwt::sort_strings(std::vector<std::pair<std::string_view, hash_type>>& strings)
+{
+    #pragma omp parallel
+    {
+        #pragma omp single
+        multikey_quicksort(strings.data(), strings.size(), 0);
+    }
+}
+
+//------------------------------------------------------------------------------
+
+vcfbwt::Arena::Position
+vcfbwt::Arena::append(std::string_view bytes)
+{
+    if (blocks.empty() or (block_used + bytes.size() > block_capacity))
+    {
+        block_capacity = std::max(bytes.size(), std::min(max_block_size, std::max(min_block_size, 2 * block_capacity)));
+        blocks.emplace_back(new char[block_capacity]);
+        block_used = 0; allocated_bytes += block_capacity;
+        
+        if (blocks.size() > std::numeric_limits<std::uint32_t>::max())
+        { spdlog::error("Too many arena blocks"); std::exit(EXIT_FAILURE); }
+    }
+    
+    Position position; position.block = blocks.size() - 1; position.offset = block_used;
+    std::memcpy(blocks.back().get() + block_used, bytes.data(), bytes.size());
+    block_used += bytes.size();
+    
+    return position;
+}
 
 //------------------------------------------------------------------------------
+
+void
+vcfbwt::AsyncWriter::open(const std::string& name)
+{
+    close();
+    
+    this->file_name = name;
+    this->file_descriptor = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file_descriptor == -1) { spdlog::error("Error opening {}: {}", file_name, std::strerror(errno)); std::exit(EXIT_FAILURE); }
+    
+    for (auto& buffer : buffers)
+    {
+        if (buffer) { continue; }
+        buffer.reset(static_cast<char*>(std::aligned_alloc(buffer_alignment, buffer_size)));
+        if (not buffer) { spdlog::error("Can't allocate the output buffers for {}", file_name); std::exit(EXIT_FAILURE); }
+    }
+    
+    this->current = buffers[0].get(); this->used = 0; this->bytes_written = 0;
+    this->pending = nullptr; this->pending_size = 0; this->stop = false;
+    this->flusher = std::thread(&AsyncWriter::flush_loop, this);
+}
+
+void
+vcfbwt::AsyncWriter::close()
+{
+    if (not is_open()) { return; }
+    
+    if (used != 0) { swap_buffers(); }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    condition.notify_all();
+    flusher.join();
+    
+    if (::close(file_descriptor) != 0) { spdlog::error("Error closing {}: {}", file_name, std::strerror(errno)); std::exit(EXIT_FAILURE); }
+    file_descriptor = -1;
+    
+    vcfbwt::DiskWrites::update(bytes_written); // Disk Stats
+}
+
+void
+vcfbwt::AsyncWriter::write(const char* data, std::size_t size)
+{
+    while (size != 0)
+    {
+        if (used == buffer_size) { swap_buffers(); }
+        std::size_t length = std::min(size, buffer_size - used);
+        std::memcpy(current + used, data, length);
+        used += length; data += length; size -= length;
+    }
+}
+
+void
+vcfbwt::AsyncWriter::swap_buffers()
+{
+    // Wait for the previous buffer to be on disk, then hand over the current one
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [&]() { return pending == nullptr; });
+        pending = current; pending_size = used;
+    }
+    condition.notify_all();
+    
+    bytes_written += used; used = 0;
+    current = (current == buffers[0].get()) ? buffers[1].get() : buffers[0].get();
+}
+
+void
+vcfbwt::AsyncWriter::flush_loop()
+{
+    while (true)
+    {
+        const char* data; std::size_t size;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [&]() { return (pending != nullptr) or stop; });
+            if (pending == nullptr) { return; } // stop requested and nothing left to write
+            data = pending; size = pending_size;
+        }
+        
+        while (size != 0)
+        {
+            ssize_t res = ::write(file_descriptor, data, size);
+            if (res < 0 and errno == EINTR) { continue; }
+            if (res < 0) { spdlog::error("Error writing {}: {}", file_name, std::strerror(errno)); std::exit(EXIT_FAILURE); }
+            data += res; size -= res;
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = nullptr;
+        }
+        condition.notify_all();
+    }
+}
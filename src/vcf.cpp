@@ -9,6 +9,364 @@
 
 const std::string vcfbwt::VCF::vcf_freq = "AF";
 
+//------------------------------------------------------------------------------
+
+namespace
+{
+
+// The variant cache is a sequence of arrays, each one its length followed by its elements padded to 8 bytes. The
+// file is mapped and the arrays wanted are copied out of it, the others skipped.
+constexpr char CACHE_MAGIC[8] = { 'P', 'F', 'P', 'V', 'A', 'R', '\0', '\0' };
+constexpr uint64_t CACHE_VERSION = 2;
+
+struct CacheWriter
+{
+    std::ofstream out;
+    
+    void put(uint64_t value) { out.write((const char*) &value, sizeof(uint64_t)); }
+    
+    template <typename T>
+    void put(const T* data, std::size_t size)
+    {
+        static constexpr char padding[8] = { 0 };
+        put(uint64_t(size)); out.write((const char*) data, size * sizeof(T));
+        out.write(padding, (8 - ((size * sizeof(T)) % 8)) % 8);
+    }
+    
+    template <typename T>
+    void put(const std::vector<T>& values) { put(values.data(), values.size()); }
+    void put(const std::string& values) { put(values.data(), values.size()); }
+};
+
+struct CacheReader
+{
+    const char* data; const char* end;
+    const std::string& path;
+    
+    uint64_t get()
+    {
+        if (end - data < std::ptrdiff_t(sizeof(uint64_t))) { spdlog::error("Truncated variant cache: {}", path); std::exit(EXIT_FAILURE); }
+        uint64_t value; std::memcpy(&value, data, sizeof(uint64_t)); data += sizeof(uint64_t);
+        return value;
+    }
+    
+    // The elements of the next array, in the mapped file
+    template <typename T>
+    std::pair<const T*, std::size_t> view()
+    {
+        uint64_t size = get(), bytes = size * sizeof(T);
+        if ((size > uint64_t(end - data) / sizeof(T)) or (uint64_t(end - data) < bytes + ((8 - (bytes % 8)) % 8)))
+        { spdlog::error("Truncated variant cache: {}", path); std::exit(EXIT_FAILURE); }
+        const T* values = (const T*) data; data += bytes + ((8 - (bytes % 8)) % 8);
+        return { values, size };
+    }
+    
+    template <typename T>
+    void get(std::vector<T>& values) { auto [first, size] = view<T>(); values.assign(first, first + size); }
+    void get(std::string& values) { auto [first, size] = view<char>(); values.assign(first, size); }
+};
+
+// ORs n bits of from, starting at bit from_bit, into to starting at bit to_bit, a word at a time
+void
+copy_bits(const std::vector<uint64_t>& from, std::size_t from_bit, std::vector<uint64_t>& to, std::size_t to_bit, std::size_t n)
+{
+    for (std::size_t done = 0; done < n; done += 64)
+    {
+        std::size_t length = std::min<std::size_t>(64, n - done), bit = from_bit + done, shift = bit % 64;
+        uint64_t word = from[bit / 64] >> shift;
+        if ((shift != 0) and (shift + length > 64)) { word |= from[bit / 64 + 1] << (64 - shift); }
+        if (length < 64) { word &= (uint64_t(1) << length) - 1; }
+        
+        bit = to_bit + done; shift = bit % 64;
+        to[bit / 64] |= word << shift;
+        if ((shift != 0) and (shift + length > 64)) { to[bit / 64 + 1] |= word >> (64 - shift); }
+    }
+}
+
+} // end namespace
+
+
+//------------------------------------------------------------------------------
+
+void
+vcfbwt::Variations::push_back(const Variation& variation)
+{
+    this->positions.push_back(variation.pos);
+    this->ref_lengths.push_back(variation.ref_len);
+    this->frequencies.push_back(variation.freq);
+    for (const auto& allele : variation.alt)
+    { this->alleles_pool.append(allele); this->allele_offsets.push_back(this->alleles_pool.size()); }
+    this->first_allele.push_back(this->first_allele.back() + variation.alt.size());
+}
+
+void
+vcfbwt::Variations::append(const Variations& other, std::size_t from)
+{
+    if (from >= other.size()) { return; }
+    std::size_t alleles_base = this->first_allele.back(), pool_base = this->alleles_pool.size();
+    std::size_t other_alleles = other.first_allele[from], other_pool = other.allele_offsets[other_alleles];
+    
+    this->positions.insert(this->positions.end(), other.positions.begin() + from, other.positions.end());
+    this->ref_lengths.insert(this->ref_lengths.end(), other.ref_lengths.begin() + from, other.ref_lengths.end());
+    this->frequencies.insert(this->frequencies.end(), other.frequencies.begin() + from, other.frequencies.end());
+    for (std::size_t i = from + 1; i < other.first_allele.size(); i++)
+    { this->first_allele.push_back(other.first_allele[i] - other_alleles + alleles_base); }
+    for (std::size_t i = other_alleles + 1; i < other.allele_offsets.size(); i++)
+    { this->allele_offsets.push_back(other.allele_offsets[i] - other_pool + pool_base); }
+    this->alleles_pool.append(other.alleles_pool, other_pool);
+}
+
+void
+vcfbwt::Variations::drop_front(std::size_t n)
+{
+    if (n == 0) { return; }
+    std::size_t alleles_base = this->first_allele[n], pool_base = this->allele_offsets[alleles_base];
+    
+    this->positions.erase(this->positions.begin(), this->positions.begin() + n);
+    this->ref_lengths.erase(this->ref_lengths.begin(), this->ref_lengths.begin() + n);
+    this->frequencies.erase(this->frequencies.begin(), this->frequencies.begin() + n);
+    this->first_allele.erase(this->first_allele.begin(), this->first_allele.begin() + n);
+    for (auto& first : this->first_allele) { first -= alleles_base; }
+    this->allele_offsets.erase(this->allele_offsets.begin(), this->allele_offsets.begin() + alleles_base);
+    for (auto& offset : this->allele_offsets) { offset -= pool_base; }
+    this->alleles_pool.erase(0, pool_base);
+}
+
+void
+vcfbwt::Variations::clear()
+{
+    this->positions.clear(); this->ref_lengths.clear(); this->frequencies.clear();
+    this->first_allele.assign(1, 0); this->allele_offsets.assign(1, 0);
+    this->alleles_pool.clear();
+}
+
+std::size_t
+vcfbwt::Variations::size_in_bytes() const
+{
+    return (this->positions.size() + this->ref_lengths.size() + this->first_allele.size() + this->allele_offsets.size()) * sizeof(std::size_t)
+    + this->frequencies.size() * sizeof(double) + this->alleles_pool.size();
+}
+
+//------------------------------------------------------------------------------
+
+void
+vcfbwt::Sample::add_variation(std::size_t id, const int* alleles, std::size_t n_alleles)
+{
+    if ((this->number_of_variations != 0) and (id <= this->last_id))
+    { spdlog::error("vcfbwt::Sample::add_variation: variations must be added by increasing id"); std::exit(EXIT_FAILURE); }
+    
+    // Varint delta from the previous id
+    std::size_t delta = id - this->last_id;
+    while (delta >= 0x80) { this->variation_deltas.push_back(uint8_t(delta | 0x80)); delta >>= 7; }
+    this->variation_deltas.push_back(uint8_t(delta));
+    if (this->number_of_variations % INDEX_STEP == 0)
+    { this->checkpoint_ids.push_back(id); this->checkpoint_offsets.push_back(this->variation_deltas.size()); }
+    
+    // Wider alleles repack the columns
+    int max_allele = 0;
+    for (std::size_t g = 0; g < n_alleles; g++) { max_allele = std::max(max_allele, alleles[g]); }
+    std::size_t bits = this->allele_bits;
+    while ((bits < 32) and (uint64_t(max_allele) >= (uint64_t(1) << bits))) { bits *= 2; }
+    widen_alleles(bits);
+    
+    // A genotype seen for the first time has reference alleles on the previous variations
+    if (n_alleles > this->allele_columns.size()) { this->allele_columns.resize(n_alleles); }
+    std::size_t bit = this->number_of_variations * this->allele_bits;
+    for (std::size_t g = 0; g < this->allele_columns.size(); g++)
+    {
+        this->allele_columns[g].resize((bit + this->allele_bits + 63) / 64, 0);
+        if ((g < n_alleles) and (alleles[g] > 0)) { this->allele_columns[g][bit / 64] |= uint64_t(alleles[g]) << (bit % 64); }
+    }
+    
+    this->number_of_variations += 1; this->last_id = id; this->read_variations += 1;
+}
+
+void
+vcfbwt::Sample::widen_alleles(std::size_t bits)
+{
+    // The width is a power of two so alleles never cross two words
+    if (bits <= this->allele_bits) { return; }
+    std::vector<std::vector<uint64_t>> columns(this->allele_columns.size());
+    for (std::size_t g = 0; g < columns.size(); g++)
+    {
+        columns[g].assign(((this->number_of_variations * bits) + 63) / 64, 0);
+        for (std::size_t i = 0; i < this->number_of_variations; i++)
+        { columns[g][(i * bits) / 64] |= uint64_t(allele(i, g)) << ((i * bits) % 64); }
+    }
+    this->allele_columns = std::move(columns); this->allele_bits = bits;
+}
+
+void
+vcfbwt::Sample::append(const Sample& other, std::size_t from_id, std::size_t base)
+{
+    // The first variation of other to append, from the last checkpoint before it
+    std::size_t checkpoint = std::partition_point(other.checkpoint_ids.begin(), other.checkpoint_ids.end(),
+    [&](std::size_t var_id) { return var_id < from_id; }) - other.checkpoint_ids.begin();
+    Cursor cursor; other.seek(cursor, (checkpoint > 0) ? (checkpoint - 1) * INDEX_STEP : 0);
+    while ((cursor.index < other.number_of_variations) and (cursor.id < from_id)) { other.next(cursor); }
+    if (cursor.index >= other.number_of_variations) { return; }
+    
+    std::size_t first_id = base + (cursor.id - from_id);
+    if ((this->number_of_variations != 0) and (first_id <= this->last_id))
+    { spdlog::error("vcfbwt::Sample::append: variations must be added by increasing id"); std::exit(EXIT_FAILURE); }
+    
+    // Only the first delta changes, the ones after it are relative to the previous variation of other. The
+    // checkpoints are moved by the offset of the first delta after it.
+    std::size_t first = this->number_of_variations, n = other.number_of_variations - cursor.index;
+    std::size_t delta = first_id - this->last_id;
+    while (delta >= 0x80) { this->variation_deltas.push_back(uint8_t(delta | 0x80)); delta >>= 7; }
+    this->variation_deltas.push_back(uint8_t(delta));
+    std::size_t offset = this->variation_deltas.size() - cursor.offset;
+    this->variation_deltas.insert(this->variation_deltas.end(), other.variation_deltas.begin() + cursor.offset, other.variation_deltas.end());
+    for (Cursor at = cursor; at.index < other.number_of_variations; other.next(at))
+    {
+        if ((first + at.index - cursor.index) % INDEX_STEP != 0) { continue; }
+        this->checkpoint_ids.push_back(base + (at.id - from_id)); this->checkpoint_offsets.push_back(at.offset + offset);
+    }
+    
+    // The alleles as bit ranges when they have the same width, one by one otherwise. Genotypes missing on either
+    // side are reference alleles.
+    widen_alleles(other.allele_bits);
+    if (other.ploidy() > ploidy()) { this->allele_columns.resize(other.ploidy(), std::vector<uint64_t>(((first * this->allele_bits) + 63) / 64, 0)); }
+    std::size_t bits = this->allele_bits;
+    for (std::size_t g = 0; g < ploidy(); g++)
+    {
+        std::vector<uint64_t>& column = this->allele_columns[g];
+        column.resize((((first + n) * bits) + 63) / 64, 0);
+        if (g >= other.ploidy()) { continue; }
+        if (other.allele_bits == bits) { copy_bits(other.allele_columns[g], cursor.index * bits, column, first * bits, n * bits); continue; }
+        for (std::size_t i = 0; i < n; i++)
+        { column[((first + i) * bits) / 64] |= uint64_t(other.allele(cursor.index + i, g)) << (((first + i) * bits) % 64); }
+    }
+    
+    this->number_of_variations += n; this->read_variations += n;
+    this->last_id = base + (other.last_id - from_id);
+}
+
+void
+vcfbwt::Sample::drop_variations_before(std::size_t id)
+{
+    Cursor cursor; seek(cursor, this->first_variation);
+    while ((cursor.index < this->number_of_variations) and (cursor.id < id)) { next(cursor); }
+    this->first_variation = cursor.index;
+    if (not this->indels_index.empty()) { build_index(); }
+}
+
+void
+vcfbwt::Sample::compact(std::size_t id)
+{
+    // The variations left are added again with the new ids
+    std::vector<std::size_t> ids; std::vector<std::vector<int>> alleles;
+    for_each_variation([&](std::size_t i, std::size_t var_id)
+    {
+        if (var_id < id) { return; }
+        ids.push_back(var_id - id); alleles.emplace_back(ploidy());
+        for (std::size_t g = 0; g < ploidy(); g++) { alleles.back()[g] = allele(i, g); }
+    });
+    
+    this->variation_deltas.clear(); this->checkpoint_ids.clear(); this->checkpoint_offsets.clear();
+    this->allele_columns.clear(); this->indels_index.clear();
+    std::size_t read = this->read_variations;
+    this->number_of_variations = 0; this->last_id = 0; this->allele_bits = 1; this->first_variation = 0;
+    for (std::size_t i = 0; i < ids.size(); i++) { add_variation(ids[i], alleles[i]); }
+    this->read_variations = read;
+}
+
+void
+vcfbwt::Sample::seek(Cursor& cursor, std::size_t i) const
+{
+    if (i >= this->number_of_variations) { cursor.index = this->number_of_variations; return; }
+    
+    std::size_t checkpoint = i / INDEX_STEP;
+    cursor.index = checkpoint * INDEX_STEP;
+    cursor.id = this->checkpoint_ids[checkpoint];
+    cursor.offset = this->checkpoint_offsets[checkpoint];
+    while (cursor.index < i) { next(cursor); }
+}
+
+void
+vcfbwt::Sample::next(Cursor& cursor) const
+{
+    cursor.index += 1;
+    if (cursor.index >= this->number_of_variations) { return; }
+    
+    std::size_t delta = 0, shift = 0; uint8_t byte;
+    do { byte = this->variation_deltas[cursor.offset++]; delta |= std::size_t(byte & 0x7F) << shift; shift += 7; } while (byte & 0x80);
+    cursor.id += delta;
+}
+
+std::size_t
+vcfbwt::Sample::size_in_bytes() const
+{
+    std::size_t bytes = this->variation_deltas.size() + (this->checkpoint_ids.size() + this->checkpoint_offsets.size()) * sizeof(std::size_t);
+    for (const auto& column : this->allele_columns) { bytes += column.size() * sizeof(uint64_t); }
+    return bytes;
+}
+
+long long int
+vcfbwt::Sample::indel(const Cursor& cursor, std::size_t genotype) const
+{
+    int var_genotype = allele(cursor.index, genotype);
+    if (var_genotype == 0) { return 0; }
+    return (long long int) this->variations_list.allele(cursor.id, var_genotype).size() - (long long int) this->variations_list.ref_len(cursor.id);
+}
+
+long long int
+vcfbwt::Sample::indels_before(std::size_t i, std::size_t genotype) const
+{
+    // From the closest indexed variation, or from the first one without index
+    std::size_t from = this->first_variation; long long int indels = 0; // could be negative, so int
+    if (genotype < this->indels_index.size())
+    { from = std::max(from, (i / INDEX_STEP) * INDEX_STEP); indels = this->indels_index[genotype][i / INDEX_STEP]; }
+    Cursor cursor; seek(cursor, from);
+    for (; cursor.index < i; next(cursor)) { indels += indel(cursor, genotype); }
+    return indels;
+}
+
+std::size_t
+vcfbwt::Sample::first_at_or_after(std::size_t position, std::size_t from) const
+{
+    // Binary search on the indexed variations, then the ones after the last indexed one before position
+    from = std::max(from, this->first_variation);
+    auto begin = this->checkpoint_ids.begin() + std::min(from / INDEX_STEP, this->checkpoint_ids.size());
+    std::size_t checkpoint = std::partition_point(begin, this->checkpoint_ids.end(),
+    [&](std::size_t var_id) { return this->variations_list.pos(var_id) < position; }) - this->checkpoint_ids.begin();
+    
+    Cursor cursor; seek(cursor, std::max(from, (checkpoint > 0) ? (checkpoint - 1) * INDEX_STEP : 0));
+    while ((cursor.index < this->number_of_variations) and (this->variations_list.pos(cursor.id) < position)) { next(cursor); }
+    return cursor.index;
+}
+
+std::size_t
+vcfbwt::Sample::last_alternate_before(std::size_t i, std::size_t genotype) const
+{
+    // Blocks of variations from the one of i backwards, the first variation if there are none
+    for (std::size_t block = (i + INDEX_STEP - 1) / INDEX_STEP; block > this->first_variation / INDEX_STEP; block--)
+    {
+        std::size_t last = i;
+        Cursor cursor; seek(cursor, std::max((block - 1) * INDEX_STEP, this->first_variation));
+        for (; cursor.index < std::min(i, block * INDEX_STEP); next(cursor)) { if (allele(cursor.index, genotype) != 0) { last = cursor.index; } }
+        if (last != i) { return last; }
+    }
+    return this->first_variation;
+}
+
+void
+vcfbwt::Sample::build_index()
+{
+    this->indels_index.assign(ploidy(), {});
+    for (std::size_t genotype = 0; genotype < ploidy(); genotype++)
+    {
+        long long int indels = 0;
+        Cursor cursor; seek(cursor, 0);
+        for (; cursor.index < this->number_of_variations; next(cursor))
+        {
+            if (cursor.index % INDEX_STEP == 0) { this->indels_index[genotype].push_back(indels); }
+            if (cursor.index >= this->first_variation) { indels += indel(cursor, genotype); }
+        }
+        if (this->number_of_variations % INDEX_STEP == 0) { this->indels_index[genotype].push_back(indels); }
+    }
+}
 
 //------------------------------------------------------------------------------
 
@@ -17,23 +375,44 @@ sample_(sample), genotype(genotype),
 ref_it_(0), sam_it_(0), var_it_(0), curr_var_it_(0), prev_variation_it(0),
 curr_char_(NULL), sample_length_(sample.reference_.size())
 {
-    // Compute sample length, might take some time
-    long long int indels = 0; // could be negative, so int
-    for (std::size_t i = 0; i < this->sample_.variations.size(); i++)
+    // Compute sample length, walks all the variations if the sample is not indexed
+    sample_length_ = sample_length_ + sample_.indels_before(sample_.number_of_variations, this->genotype);
+    prev_variation_it = sample_.first_variation;
+    sample_.seek(cursor_, sample_.first_variation);
+    to_alternate(sample_.first_variation);
+    this->operator++();
+}
+
+vcfbwt::Sample::iterator::iterator(const Sample& sample, std::size_t genotype, std::size_t position) :
+iterator(sample, genotype)
+{
+    // First variation at or after position, variations are sorted by position
+    std::size_t first = sample_.first_at_or_after(position);
+    
+    // Characters before position, with the indels of the previous variations
+    long long int indels = sample_.indels_before(first, this->genotype);
+    prev_variation_it = sample_.last_alternate_before(first, this->genotype);
+    
+    to_alternate(first);
+    ref_it_ = position; sam_it_ = position + indels; curr_var_it_ = 0;
+    this->operator++();
+}
+
+void
+vcfbwt::Sample::iterator::to_alternate(std::size_t i)
+{
+    // Far variations are sought from the index, close ones decoded one after the other
+    if ((i < cursor_.index) or (i > cursor_.index + INDEX_STEP)) { sample_.seek(cursor_, i); }
+    while (cursor_.index < i) { sample_.next(cursor_); }
+    while ((cursor_.index < sample_.number_of_variations) and (sample_.allele(cursor_.index, genotype) == 0)) { sample_.next(cursor_); }
+    
+    var_it_ = cursor_.index;
+    if (has_variation())
     {
-        std::size_t var_id = this->sample_.variations[i];
-        int var_genotype = this->sample_.genotypes[i][this->genotype];
-        if (var_genotype != 0)
-        {
-            indels += sample_.variations_list[var_id].alt[var_genotype].size() -
-                      sample_.variations_list[var_id].ref_len;
-        }
-        
+        const Variations& variations = sample_.variations_list;
+        curr_pos_ = variations.pos(cursor_.id); curr_ref_len_ = variations.ref_len(cursor_.id);
+        curr_alt_ = variations.allele(cursor_.id, sample_.allele(var_it_, genotype)); curr_ref_ = variations.allele(cursor_.id, 0);
     }
-    sample_length_ = sample_length_ + indels;
-    while (var_it_ < sample_.variations.size() and sample_.genotypes[var_it_][genotype] == 0)
-    { var_it_++; }
-    this->operator++();
 }
 
 bool
@@ -45,22 +424,21 @@ vcfbwt::Sample::iterator::operator*() { return *curr_char_; }
 bool
 vcfbwt::Sample::iterator::in_a_variation()
 {
-    const Variation& curr_variation = sample_.variations_list[sample_.variations[var_it_]];
-    return (ref_it_ == curr_variation.pos);
+    return (ref_it_ == curr_pos_);
 }
 
 std::size_t
 vcfbwt::Sample::iterator::next_variation() const
 {
-    if (var_it_ < sample_.variations.size()) { return sample_.get_variation(var_it_).pos; }
+    if (has_variation()) { return curr_pos_; }
     else { return sample_.reference_.size() - 1; }
 }
 
 std::size_t
 vcfbwt::Sample::iterator::prev_variation() const
 {
-    if (var_it_ == 0) { spdlog::error("vcfbwt::Sample::iterator::prev_variation() var_it == 0"); std::exit(EXIT_FAILURE); }
-    return sample_.get_variation(prev_variation_it).pos;
+    if (var_it_ == sample_.first_variation) { spdlog::error("vcfbwt::Sample::iterator::prev_variation() no previous variation"); std::exit(EXIT_FAILURE); }
+    return sample_.variations_list.pos(sample_.variation_id(prev_variation_it));
 }
 
 std::size_t
@@ -73,28 +451,25 @@ void
 vcfbwt::Sample::iterator::operator++()
 {
     // Ci sono ancora variazioni da processare
-    if (var_it_ < sample_.variations.size())
+    if (has_variation())
     {
-        const Variation& curr_variation = sample_.variations_list[sample_.variations[var_it_]];
-        
-        if (ref_it_ < curr_variation.pos)
+        if (ref_it_ < curr_pos_)
         {
             curr_char_ = &(sample_.reference_[ref_it_]); ref_it_++; sam_it_++;
             return;
         }
         
         // Più nucleotidi nella variaizione
-        int var_genotype = sample_.genotypes[var_it_][genotype];
         // Handling same position insertions see bcftools consensus:
         // https://github.com/samtools/bcftools/blob/df43fd4781298e961efc951ba33fc4cdcc165a19/consensus.c#L723
-        int gap = ref_it_ - curr_variation.pos;
+        int gap = ref_it_ - curr_pos_;
         if (gap > curr_var_it_)
         {
             // Check length of unchanged bases
             int start = 0;
-            int len = curr_variation.alt[var_genotype].size();
+            int len = curr_alt_.size();
             assert(len >= gap);
-            while (start < std::min(gap, len) && curr_variation.alt[var_genotype][start] == curr_variation.alt[0][start])
+            while (start < std::min(gap, len) && curr_alt_[start] == curr_ref_[start])
                 ++start;
             if (start < gap)
             {
@@ -108,14 +483,14 @@ vcfbwt::Sample::iterator::operator++()
         bool get_next_variant = true;
         bool iterate = false;
 
-        if (curr_var_it_ < curr_variation.alt[var_genotype].size() - 1)
+        if (curr_var_it_ < curr_alt_.size() - 1)
         {
-            curr_char_ = &curr_variation.alt[var_genotype][curr_var_it_];
+            curr_char_ = &curr_alt_[curr_var_it_];
             curr_var_it_++;
             get_next_variant = false;
         }
-        else if (curr_var_it_ < curr_variation.alt[var_genotype].size())
-            curr_char_ = &curr_variation.alt[var_genotype].back();
+        else if (curr_var_it_ < curr_alt_.size())
+            curr_char_ = &curr_alt_.back();
         else
             iterate = true; // We evaluate the next position that might be either on the reference or another variation
 
@@ -123,13 +498,9 @@ vcfbwt::Sample::iterator::operator++()
         if (get_next_variant)
         {
             prev_variation_it = var_it_;
-            var_it_++;
-            while (var_it_ < sample_.variations.size() and sample_.genotypes[var_it_][genotype] == 0)
-            {
-                var_it_++;
-            }
+            ref_it_ += curr_ref_len_ - gap; // Adding -gap to balance the sipping
+            to_alternate(var_it_ + 1);
             curr_var_it_ = 0;
-            ref_it_ += curr_variation.ref_len - gap; // Adding -gap to balance the sipping
         }
 
         if (iterate) this->operator++();
@@ -152,13 +523,99 @@ vcfbwt::Sample::iterator::go_to(std::size_t i)
         std::exit(EXIT_FAILURE);
     }
     
-    // Not an efficient implementation, TODO: make it more efficient
     while (ref_it_ < i)
     {
-        this->operator++();
+        // Reference characters before the next variation are skipped at once, the variations before i too if the
+        // sample is indexed, otherwise they are stepped over one char at a time
+        std::size_t next = has_variation() ? curr_pos_ : sample_.reference_.size();
+        if (ref_it_ < next)
+        {
+            std::size_t to = std::min(i, next);
+            sam_it_ += to - ref_it_; ref_it_ = to;
+            curr_char_ = &(sample_.reference_[ref_it_ - 1]);
+        }
+        else if ((curr_var_it_ != 0) or (not skip_variations(i))) { this->operator++(); }
     }
 }
 
+bool
+vcfbwt::Sample::iterator::skip_variations(std::size_t i)
+{
+    if (genotype >= sample_.indels_index.size()) { return false; }
+    
+    // The last variation of this genotype before i where the previous char is on the reference and not in the
+    // previous variation. Variations are decoded forward, from the block of the last variation before i backwards.
+    std::size_t first_after = sample_.first_at_or_after(i, var_it_);
+    for (std::size_t block = (first_after + INDEX_STEP - 1) / INDEX_STEP; block > var_it_ / INDEX_STEP; block--)
+    {
+        std::size_t from = std::max(var_it_, (block - 1) * INDEX_STEP);
+        Cursor cursor, target; std::size_t prev = 0, prev_end = 0; bool has_prev = false, found = false;
+        std::size_t target_prev = 0;
+        for (sample_.seek(cursor, from); cursor.index < first_after; sample_.next(cursor))
+        {
+            if (sample_.allele(cursor.index, genotype) == 0) { continue; }
+            std::size_t position = sample_.variations_list.pos(cursor.id);
+            if (has_prev and (prev_end < position)) { target = cursor; target_prev = prev; found = true; }
+            has_prev = true; prev = cursor.index; prev_end = position + std::max<std::size_t>(sample_.variations_list.ref_len(cursor.id), 1);
+        }
+        
+        if (found)
+        {
+            std::size_t position = sample_.variations_list.pos(target.id);
+            ref_it_ = position; sam_it_ = position + sample_.indels_before(target.index, genotype);
+            prev_variation_it = target_prev; curr_var_it_ = 0;
+            cursor_ = target; to_alternate(target.index);
+            curr_char_ = &(sample_.reference_[ref_it_ - 1]);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+vcfbwt::Sample::iterator::on_reference() const
+{
+    const char* reference = sample_.reference_.data();
+    return std::less_equal<const char*>()(reference, curr_char_) and std::less<const char*>()(curr_char_, reference + sample_.reference_.size());
+}
+
+std::string_view
+vcfbwt::Sample::iterator::span() const
+{
+    if (on_reference())
+    {
+        // Up to the next variation, a variation overlapping the previous one comes right after
+        std::size_t next = has_variation() ? curr_pos_ : sample_.reference_.size();
+        return std::string_view(curr_char_, (next >= ref_it_) ? next - (ref_it_ - 1) : 1);
+    }
+    
+    // The last char of an allele moves to the next variation already, it's a span on its own
+    if (curr_var_it_ == 0) { return std::string_view(curr_char_, 1); }
+    return std::string_view(curr_char_, curr_alt_.size() - (curr_var_it_ - 1));
+}
+
+void
+vcfbwt::Sample::iterator::advance(std::size_t n)
+{
+    // Inside a reference span the first n - 1 chars are skipped at once
+    if ((n > 1) and on_reference()) { ref_it_ += n - 1; sam_it_ += n - 1; curr_char_ += n - 1; n = 1; }
+    for (; n > 0; n--) { this->operator++(); }
+}
+
+//------------------------------------------------------------------------------
+
+void
+vcfbwt::VCF::init_thread_pool()
+{
+    // Shared by all the vcfs opened, including the shards read in parallel
+    int threads = omp_get_max_threads();
+    if ((threads < 2) or (this->thread_pool.pool != nullptr)) { return; }
+    
+    this->thread_pool.pool = hts_tpool_init(threads);
+    if (this->thread_pool.pool == nullptr) { spdlog::warn("Can't create the htslib thread pool"); return; }
+    spdlog::info("Decompressing the vcfs with {} threads", threads);
+}
+
 //------------------------------------------------------------------------------
 
 void
@@ -202,13 +659,12 @@ vcfbwt::VCF::init_ref(const std::string& ref_path, bool last)
 //------------------------------------------------------------------------------
 
 void
-vcfbwt::VCF::init_vcf(const std::string& vcf_path, std::vector<Variation>& l_variations,
-                      std::vector<Sample>& l_samples, std::unordered_map<std::string, std::size_t>& l_samples_id,
-                      std::size_t i)
+vcfbwt::VCF::open_vcf(Reader& reader, const std::string& vcf_path, Variations& l_variations, std::vector<Sample>& l_samples,
+                      std::unordered_map<std::string, std::size_t>& l_samples_id, std::size_t i, bool add_samples)
 {
     // open VCF file
-    htsFile * inf = bcf_open(vcf_path.c_str(), "r");
-    if (inf == NULL)
+    reader.file = bcf_open(vcf_path.c_str(), "r");
+    if (reader.file == NULL)
     {
         spdlog::error("Can't open vcf file: {}", vcf_path);
         std::exit(EXIT_FAILURE);
@@ -217,16 +673,16 @@ vcfbwt::VCF::init_vcf(const std::string& vcf_path, std::vector<Variation>& l_var
     spdlog::info("Parsing vcf: {}", vcf_path);
     
     // read header
-    bcf_hdr_t *hdr = bcf_hdr_read(inf);
+    reader.header = bcf_hdr_read(reader.file);
     
     // get l_samples ids from header
-    std::size_t n_samples = bcf_hdr_nsamples(hdr);
+    std::size_t n_samples = bcf_hdr_nsamples(reader.header);
     if (this->max_samples == 0) { set_max_samples(n_samples); }
 
     std::size_t size_before = l_samples.size();
-    for (std::size_t i = 0; i < std::min(n_samples, this->max_samples); i++)
+    for (std::size_t i = 0; add_samples and (i < std::min(n_samples, this->max_samples)); i++)
     {
-        vcfbwt::Sample s(std::string(hdr->samples[i]), this->reference, l_variations);
+        vcfbwt::Sample s(std::string(reader.header->samples[i]), this->reference, l_variations);
         if (l_samples_id.find(s.id()) == l_samples_id.end())
         {
             l_samples.push_back(s);
@@ -235,149 +691,355 @@ vcfbwt::VCF::init_vcf(const std::string& vcf_path, std::vector<Variation>& l_var
     }
     spdlog::debug("{} new l_samples in the vcf, tot: {}", l_samples.size() - size_before, l_samples.size());
     
+    // Keep only the wanted samples in the header, htslib then never decodes the genotypes of the others. So a symbolic
+    // allele of a sample not wanted doesn't skip the record for the samples after it.
+    std::string wanted; std::size_t n_wanted = 0;
+    for (std::size_t i_s = 0; i_s < n_samples; i_s++)
+    {
+        auto id = l_samples_id.find(std::string(reader.header->samples[i_s]));
+        if ((id != l_samples_id.end() and id->second < max_samples) and
+        ((input_samples.empty()) or input_samples.contains(id->first)))
+        {
+            if (n_wanted++ != 0) { wanted.push_back(','); }
+            wanted.append(id->first);
+        }
+    }
+    if (n_wanted != 0 and n_wanted < n_samples)
+    {
+        if (bcf_hdr_set_samples(reader.header, wanted.c_str(), 0) != 0)
+        {
+            spdlog::error("Can't select the samples of vcf file: {}", vcf_path);
+            std::exit(EXIT_FAILURE);
+        }
+        spdlog::debug("Decoding {} samples out of {}", n_wanted, n_samples);
+        n_samples = bcf_hdr_nsamples(reader.header);
+    }
+    
+    // BGZF blocks are inflated by the shared pool
+    if (this->thread_pool.pool != nullptr) { hts_set_thread_pool(reader.file, &this->thread_pool); }
+    
+    // Where the variations of each sample go, looked up once
+    reader.samples.assign(n_samples, std::string::npos);
+    for (std::size_t i_s = 0; i_s < n_samples; i_s++)
+    {
+        auto id = l_samples_id.find(std::string(reader.header->samples[i_s]));
+        if ((id != l_samples_id.end() and id->second < max_samples) and
+        ((input_samples.empty()) or input_samples.contains(id->first))) // Process only wanted l_samples
+        { reader.samples[i_s] = id->second; }
+    }
+    
     // struct for storing each record
-    bcf1_t *rec = bcf_init();
-    if (rec == NULL)
+    reader.record = bcf_init();
+    if (reader.record == NULL)
     {
         spdlog::error("Error while parsing vcf file: {}", vcf_path);
-        bcf_close(inf);
-        bcf_hdr_destroy(hdr);
+        bcf_close(reader.file);
+        bcf_hdr_destroy(reader.header);
         std::exit(EXIT_FAILURE);
     }
 
-    std::vector<std::vector<int>> tppos(1, std::vector<int>(n_samples,0));
-    std::vector<std::vector<bool>> prev_is_ins(1, std::vector<bool>(n_samples,false));
+    reader.tppos.assign(1, std::vector<int>(n_samples,0));
+    reader.prev_is_ins.assign(1, std::vector<bool>(n_samples,false));
+    reader.offset = i != 0 ? ref_sum_lengths[i-1] : 0;
+}
+
+bool
+vcfbwt::VCF::read_record(Reader& reader, Variations& l_variations, std::vector<Sample>& l_samples)
+{
+    bcf_hdr_t* hdr = reader.header; bcf1_t* rec = reader.record;
+    std::size_t n_samples = reader.samples.size();
+    auto& tppos = reader.tppos; auto& prev_is_ins = reader.prev_is_ins;
     
-    // start parsing
-    while (bcf_read(inf, hdr, rec) == 0)
+    // The records of a shard starting before it belong to the previous one
+    int status;
+    do
     {
-        vcfbwt::Variation var;
-        
-        var.ref_len = rec->rlen;
-        std::size_t offset = i != 0 ? ref_sum_lengths[i-1] : 0; // when using multiple vcfs
-        var.pos = rec->pos + offset;
-        var.freq = 0;
-        
-        // get all alternate alleles
-        bcf_unpack(rec, BCF_UN_ALL);
-        int type = bcf_get_variant_types(rec);
-        for (int allele_idx = 0; allele_idx < rec->n_allele; allele_idx++)
+        if (reader.iterator == nullptr) { status = bcf_read(reader.file, hdr, rec); }
+        else if (reader.tbx_index != nullptr)
         {
-            var.alt.push_back(rec->d.allele[allele_idx]);
+            status = tbx_itr_next(reader.file, reader.tbx_index, reader.iterator, &reader.line);
+            if (status >= 0) { status = vcf_parse(&reader.line, hdr, rec); }
         }
-        
-        int32_t *gt_arr = NULL, ngt_arr = 0;
-        int ngt = bcf_get_genotypes(hdr, rec, &gt_arr, &ngt_arr);
-        if ( ngt > 0 )
+        else { status = bcf_itr_next(reader.file, reader.iterator, rec); }
+    } while ((status >= 0) and (rec->pos < hts_pos_t(reader.begin)));
+    if (status < 0) { return false; }
+    
+    if (reader.settling)
+    {
+        if (rec->pos > hts_pos_t(reader.settled)) { reader.settled = rec->pos + reader.offset; reader.settling = false; return false; }
+        reader.settled = std::max<std::size_t>(reader.settled, rec->pos + rec->rlen - 1);
+    }
+    
+    // The alleles of the record are copied into the strings of the previous one and then into the alleles pool, the
+    // genotypes into the buffers of the reader, so there are no allocations once they are large enough
+    vcfbwt::Variation& var = reader.variation;
+    var.ref_len = rec->rlen;
+    var.pos = rec->pos + reader.offset;
+    var.freq = 0;
+    var.used = false;
+    
+    // get all alternate alleles, info and filters are never looked at
+    bcf_unpack(rec, BCF_UN_STR | BCF_UN_FMT);
+    var.alt.resize(rec->n_allele);
+    for (int allele_idx = 0; allele_idx < rec->n_allele; allele_idx++)
+    {
+        var.alt[allele_idx].assign(rec->d.allele[allele_idx]);
+    }
+    
+    int ngt = bcf_get_genotypes(hdr, rec, &reader.gt_arr, &reader.ngt_arr);
+    if ( ngt > 0 )
+    {
+        int max_ploidy = ngt/n_samples;
+        while (max_ploidy > tppos.size())
         {
-            int max_ploidy = ngt/n_samples;
-            while (max_ploidy > tppos.size())
-            {
-                tppos.push_back(std::vector<int>(n_samples,0));
-                prev_is_ins.push_back(std::vector<bool>(n_samples,false));
-            }
-            bool skip_this_variation = false;
-            for (std::size_t i_s = 0; i_s < n_samples; i_s++)
+            tppos.push_back(std::vector<int>(n_samples,0));
+            prev_is_ins.push_back(std::vector<bool>(n_samples,false));
+        }
+        bool skip_this_variation = false;
+        for (std::size_t i_s = 0; i_s < n_samples; i_s++)
+        {
+            if (skip_this_variation) { break; }
+            int32_t *ptr = reader.gt_arr + i_s * max_ploidy;
+            std::vector<int>& alleles_idx = reader.alleles;
+            alleles_idx.assign(max_ploidy, 0);
+            bool alt_alleles_set = false;
+            for (std::size_t j = 0; j < max_ploidy; j++)
             {
-                if (skip_this_variation) { break; }
-                int32_t *ptr = gt_arr + i_s * max_ploidy;
-                std::vector<int> alleles_idx(max_ploidy, 0);
-                bool alt_alleles_set = false;
-                for (std::size_t j = 0; j < max_ploidy; j++)
+                // if true, the sample has smaller ploidy
+                if ( ptr[j]==bcf_int32_vector_end ) { break; }
+
+                // missing allele
+                if ( bcf_gt_is_missing(ptr[j]) ) { continue; }
+                
+                if (bcf_gt_allele(ptr[j]))
                 {
-                    // if true, the sample has smaller ploidy
-                    if ( ptr[j]==bcf_int32_vector_end ) { break; }
+                    // the VCF 0-based allele index
+                    int allele_index = bcf_gt_allele(ptr[j]);
+                    int var_type = bcf_get_variant_type(rec, allele_index);
 
-                    // missing allele
-                    if ( bcf_gt_is_missing(ptr[j]) ) { continue; }
-                    
-                    if (bcf_gt_allele(ptr[j]))
-                    {
-                        // the VCF 0-based allele index
-                        int allele_index = bcf_gt_allele(ptr[j]);
-                        int var_type = bcf_get_variant_type(rec, allele_index);
-
-                        // Determine if overlap. Logic copied from leviosam's: 
-                        // https://github.com/alshai/levioSAM/blob/f72d84ad1141c84e4b315c0dc5d705d2c0d5b936/src/leviosam.hpp#L530
-                        // copied from bcftools consensus`:
-                        // https://github.com/samtools/bcftools/blob/df43fd4781298e961efc951ba33fc4cdcc165a19/consensus.c#L579
-
-                        // For some variant types POS+REF refer to the base *before* the event; in such case set trim_beg
-                        int trim_beg = 0;
-                        int var_len  = rec->d.var[allele_index].n;
-                        if ( var_type & VCF_INDEL ) trim_beg = 1;
-                        else if ( (var_type & VCF_OTHER) && !strcasecmp(rec->d.allele[allele_index],"<DEL>") ) {
-                            trim_beg = 1;
-                            var_len  = 1 - var.ref_len;
-                        }
-                        else if ( (var_type & VCF_OTHER) && !strncasecmp(rec->d.allele[allele_index],"<INS",4) )
-                            trim_beg = 1;
-
-                        if (rec->pos <= tppos[j][i_s]) {
-                            int overlap = 0;
-                            if ( rec->pos < tppos[j][i_s] || !trim_beg || var_len==0 || prev_is_ins[j][i_s] ) overlap = 1;
-                            if (overlap) {
-                                spdlog::debug("vcfbwt::VCF::init_vcf: Skipping overlapping variantat sample {} in pos {}", i_s, var.pos);
-                                continue;
-                            }
-                        }
+                    // Determine if overlap. Logic copied from leviosam's: 
+                    // https://github.com/alshai/levioSAM/blob/f72d84ad1141c84e4b315c0dc5d705d2c0d5b936/src/leviosam.hpp#L530
+                    // copied from bcftools consensus`:
+                    // https://github.com/samtools/bcftools/blob/df43fd4781298e961efc951ba33fc4cdcc165a19/consensus.c#L579
 
-                        // Skip symbolic allele
-                        if (var.alt[allele_index][0] == '<')
-                        {
-                            spdlog::debug("vcfbwt::VCF::init_vcf: Skipping symbolic allele at pos {}", var.pos);
-                            skip_this_variation = true;
+                    // For some variant types POS+REF refer to the base *before* the event; in such case set trim_beg
+                    int trim_beg = 0;
+                    int var_len  = rec->d.var[allele_index].n;
+                    if ( var_type & VCF_INDEL ) trim_beg = 1;
+                    else if ( (var_type & VCF_OTHER) && !strcasecmp(rec->d.allele[allele_index],"<DEL>") ) {
+                        trim_beg = 1;
+                        var_len  = 1 - var.ref_len;
+                    }
+                    else if ( (var_type & VCF_OTHER) && !strncasecmp(rec->d.allele[allele_index],"<INS",4) )
+                        trim_beg = 1;
+
+                    if (rec->pos <= tppos[j][i_s]) {
+                        int overlap = 0;
+                        if ( rec->pos < tppos[j][i_s] || !trim_beg || var_len==0 || prev_is_ins[j][i_s] ) overlap = 1;
+                        if (overlap) {
+                            spdlog::debug("vcfbwt::VCF::init_vcf: Skipping overlapping variantat sample {} in pos {}", i_s, var.pos);
                             continue;
                         }
-                        // Update tppos and prev_is_ins
-                        tppos[j][i_s] = rec->pos + rec->rlen - 1;
-                        prev_is_ins[j][i_s] = (var.alt[0].size() < var.alt[allele_index].size());
-
-                        alleles_idx[j] = allele_index;
-                        alt_alleles_set = true;
                     }
-                }
-                
-                if (alt_alleles_set)
-                {
-                    auto id = l_samples_id.find(std::string(hdr->samples[i_s]));
-                    if ((id != l_samples_id.end() and id->second < max_samples) and
-                    ((input_samples.empty()) or input_samples.contains(id->first))) // Process only wanted l_samples
+
+                    // Skip symbolic allele
+                    if (var.alt[allele_index][0] == '<')
                     {
-                        // Update frequency, to be normalized by the number of samples when parsing ends
-                        var.freq += 1;
-                        var.used = true;
-                        // Add variation to sample, size() because we have not added the variations to the list yet
-                        l_samples[id->second].variations.emplace_back(l_variations.size());
-                        l_samples[id->second].genotypes.emplace_back(alleles_idx);
+                        spdlog::debug("vcfbwt::VCF::init_vcf: Skipping symbolic allele at pos {}", var.pos);
+                        skip_this_variation = true;
+                        continue;
                     }
+                    // Update tppos and prev_is_ins
+                    tppos[j][i_s] = rec->pos + rec->rlen - 1;
+                    prev_is_ins[j][i_s] = (var.alt[0].size() < var.alt[allele_index].size());
+
+                    alleles_idx[j] = allele_index;
+                    alt_alleles_set = true;
                 }
             }
+            
+            if (alt_alleles_set and (reader.samples[i_s] != std::string::npos))
+            {
+                // Update frequency, to be normalized by the number of samples when parsing ends
+                var.freq += 1;
+                var.used = true;
+                // Add variation to sample, size() because we have not added the variations to the list yet
+                l_samples[reader.samples[i_s]].add_variation(l_variations.size(), alleles_idx.data(), alleles_idx.size());
+            }
         }
-        if (var.used) { l_variations.push_back(var); }
-        free(gt_arr);
     }
+    if (var.used) { l_variations.push_back(var); }
     
+    return true;
+}
+
+void
+vcfbwt::VCF::close_vcf(Reader& reader)
+{
     // free allocated memory
-    bcf_hdr_destroy(hdr);
-    bcf_close(inf);
-    bcf_destroy(rec);
+    bcf_hdr_destroy(reader.header);
+    bcf_close(reader.file);
+    bcf_destroy(reader.record);
+    if (reader.iterator != nullptr) { hts_itr_destroy(reader.iterator); }
+    free(reader.line.s); free(reader.gt_arr);
+    reader.gt_arr = nullptr; reader.ngt_arr = 0;
+    reader.file = nullptr; reader.header = nullptr; reader.record = nullptr; reader.iterator = nullptr; reader.line = { 0, 0, nullptr };
+}
+
+bool
+vcfbwt::VCF::read_shards(Reader& reader, const std::string& vcf_path, Variations& l_variations, std::vector<Sample>& l_samples,
+                         std::unordered_map<std::string, std::size_t>& l_samples_id, std::size_t i)
+{
+    if (omp_in_parallel() or (omp_get_max_threads() < 2)) { return false; }
+    
+    // Tabix index for vcf.gz, csi for bcf. Only vcfs with a single contig are split.
+    bool is_bcf = (hts_get_format(reader.file)->format == bcf);
+    hts_idx_t* index = is_bcf ? bcf_index_load(vcf_path.c_str()) : nullptr;
+    tbx_t* tbx_index = is_bcf ? nullptr : tbx_index_load(vcf_path.c_str());
+    if ((index == nullptr) and (tbx_index == nullptr)) { spdlog::info("No index for {}, decoding it sequentially", vcf_path); return false; }
+    
+    int n_contigs = 0;
+    const char** contigs = is_bcf ? bcf_index_seqnames(index, reader.header, &n_contigs) : tbx_seqnames(tbx_index, &n_contigs);
+    std::string contig = (n_contigs == 1) ? contigs[0] : "";
+    free(contigs);
+    
+    // Shards of the same length of the reference of this vcf
+    std::size_t length = ref_sum_lengths[i] - ((i != 0) ? ref_sum_lengths[i - 1] : 0);
+    std::size_t n_shards = std::min<std::size_t>(4 * omp_get_max_threads(), length / 100000);
+    if (contig.empty() or (n_shards < 2))
+    {
+        if (index != nullptr) { hts_idx_destroy(index); } else { tbx_destroy(tbx_index); }
+        return false;
+    }
+    spdlog::info("Decoding {} in {} shards", vcf_path, n_shards);
+    
+    // The first shard goes straight to the output
+    std::vector<Reader> readers(n_shards);
+    std::vector<Variations> shard_variations(n_shards), settle_variations(n_shards);
+    std::vector<std::vector<Sample>> shard_samples(n_shards), settle_samples(n_shards);
+    auto shard_begin = [&](std::size_t k) { return (k * length) / n_shards; };
+    auto decode = [&](std::size_t k, Variations& variations, std::vector<Sample>& samples)
+    {
+        Reader& shard = readers[k];
+        std::string region = contig + ":" + std::to_string(shard_begin(k) + 1) + "-";
+        if (k + 1 < n_shards) { region += std::to_string(shard_begin(k + 1)); }
+        shard.begin = shard_begin(k); shard.tbx_index = tbx_index;
+        shard.iterator = is_bcf ? bcf_itr_querys(index, shard.header, region.c_str()) : tbx_itr_querys(tbx_index, region.c_str());
+        if (shard.iterator == nullptr) { spdlog::error("Can't query {} in {}", region, vcf_path); std::exit(EXIT_FAILURE); }
+        
+        while (read_record(shard, variations, samples)) { }
+        hts_itr_destroy(shard.iterator); shard.iterator = nullptr;
+    };
+    
+    for (std::size_t k = 1; k < n_shards; k++)
+    { for (const auto& sample : l_samples) { shard_samples[k].emplace_back(sample.id(), this->reference, shard_variations[k]); } }
+    for (std::size_t k = 0; k < n_shards; k++) { open_vcf(readers[k], vcf_path, l_variations, l_samples, l_samples_id, i, false); }
+    
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (std::size_t k = 0; k < n_shards; k++)
+    { if (k == 0) { decode(k, l_variations, l_samples); } else { decode(k, shard_variations[k], shard_samples[k]); } }
+    
+    // Each shard starts with no previous variation. That is right when no variation accepted before the shard goes
+    // into it, since the overlap state of a sample only matters for its records starting up to the end of its last
+    // variation. Otherwise the start of the shard is decoded again from the state at the end of the previous one, up
+    // to the first record past the end of every variation before it and of every record read again. From there on
+    // the decoding is the same as with no previous state, the variations decoded first are kept.
+    std::vector<std::vector<int>> tppos = readers[0].tppos;
+    std::vector<std::vector<bool>> prev_is_ins = readers[0].prev_is_ins;
+    std::vector<std::size_t> settled(n_shards, 0);
+    std::size_t redecoded = 0, redecoded_variations = 0;
+    for (std::size_t k = 1; k < n_shards; k++)
+    {
+        Reader& shard = readers[k];
+        int reach = -1;
+        for (const auto& genotype : tppos) { for (int end : genotype) { reach = std::max(reach, end); } }
+        
+        if ((reach >= 0) and (std::size_t(reach) >= shard.begin))
+        {
+            std::vector<std::vector<int>> shard_tppos = std::move(shard.tppos);
+            std::vector<std::vector<bool>> shard_prev_is_ins = std::move(shard.prev_is_ins);
+            for (const auto& sample : l_samples) { settle_samples[k].emplace_back(sample.id(), this->reference, settle_variations[k]); }
+            shard.tppos = tppos; shard.prev_is_ins = prev_is_ins;
+            shard.settling = true; shard.settled = reach;
+            decode(k, settle_variations[k], settle_samples[k]);
+            
+            redecoded++; redecoded_variations += settle_variations[k].size();
+            settled[k] = shard.settling ? std::string::npos : shard.settled;
+            spdlog::debug("Shard {} decoded again up to {}, {} variations", k, shard.settling ? "its end" : std::to_string(shard.settled), settle_variations[k].size());
+            if (shard.settling) { tppos = shard.tppos; prev_is_ins = shard.prev_is_ins; continue; }
+            shard.tppos = std::move(shard_tppos); shard.prev_is_ins = std::move(shard_prev_is_ins);
+        }
+        
+        // Samples that had a variation in this shard take its state
+        tppos.resize(std::max(tppos.size(), shard.tppos.size()), std::vector<int>(shard.samples.size(), 0));
+        prev_is_ins.resize(tppos.size(), std::vector<bool>(shard.samples.size(), false));
+        for (std::size_t j = 0; j < shard.tppos.size(); j++)
+        {
+            for (std::size_t i_s = 0; i_s < shard.samples.size(); i_s++)
+            {
+                if ((shard.tppos[j][i_s] >= 0) and (std::size_t(shard.tppos[j][i_s]) >= shard.begin))
+                { tppos[j][i_s] = shard.tppos[j][i_s]; prev_is_ins[j][i_s] = shard.prev_is_ins[j][i_s]; }
+            }
+        }
+    }
+    if (redecoded != 0)
+    { spdlog::info("{} shards start inside a variation, {} variations decoded again at their start", redecoded, redecoded_variations); }
+    
+    // Variations of the next shards after the ones of the first, the genotypes of each sample appended as they are
+    // with the ids shifted. A shard decoded again at its start goes on with the variations decoded first past it.
+    struct Piece { const Variations* variations; const std::vector<Sample>* samples; std::size_t from, base; };
+    std::vector<Piece> pieces;
+    for (std::size_t k = 1; k < n_shards; k++)
+    {
+        std::size_t from = 0;
+        if (settled[k] != 0)
+        {
+            pieces.push_back({ &settle_variations[k], &settle_samples[k], 0, l_variations.size() });
+            l_variations.append(settle_variations[k]);
+            while ((from < shard_variations[k].size()) and (shard_variations[k].pos(from) < settled[k])) { from++; }
+        }
+        pieces.push_back({ &shard_variations[k], &shard_samples[k], from, l_variations.size() });
+        l_variations.append(shard_variations[k], from);
+    }
+    
+    #pragma omp parallel for schedule(dynamic)
+    for (std::size_t s = 0; s < l_samples.size(); s++)
+    { for (const Piece& piece : pieces) { l_samples[s].append((*piece.samples)[s], piece.from, piece.base); } }
+    
+    for (auto& shard : readers) { close_vcf(shard); }
+    if (index != nullptr) { hts_idx_destroy(index); } else { tbx_destroy(tbx_index); }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+void
+vcfbwt::VCF::init_vcf(const std::string& vcf_path, Variations& l_variations,
+                      std::vector<Sample>& l_samples, std::unordered_map<std::string, std::size_t>& l_samples_id,
+                      std::size_t i)
+{
+    // An indexed vcf is decoded in shards in parallel, if there are idle threads
+    Reader reader;
+    open_vcf(reader, vcf_path, l_variations, l_samples, l_samples_id, i);
+    if (not read_shards(reader, vcf_path, l_variations, l_samples, l_samples_id, i))
+    { while (read_record(reader, l_variations, l_samples)) { } }
+    close_vcf(reader);
     
     // Compute normalized variations frequency
     std::size_t number_of_samples = 0;
-    for (auto& s : l_samples) { if (s.variations.size() > 0) { number_of_samples += 1; } }
-    for (auto& v : l_variations) { v.freq = v.freq / double(number_of_samples); }
+    for (auto& s : l_samples) { if (s.variations_size() > 0) { number_of_samples += 1; } }
+    for (std::size_t v = 0; v < l_variations.size(); v++) { l_variations.set_freq(v, l_variations.freq(v) / double(number_of_samples)); }
     
     // print some statistics
-    spdlog::info("Variations size [{}]: {}GB", l_variations.size(), inGigabytes(l_variations.size() * sizeof(Variation)));
+    spdlog::info("Variations size [{}]: {}GB", l_variations.size(), inGigabytes(l_variations.size_in_bytes()));
     spdlog::info("Reference size: {} GB", inGigabytes(reference.size()));
     
     std::size_t tot_a_s = 0;
     for (auto& s : l_samples)
     {
-        tot_a_s += s.variations.size();
+        tot_a_s += s.size_in_bytes();
     }
-    spdlog::info("Samples size: {} GB", inGigabytes(tot_a_s * 8));
+    spdlog::info("Samples size: {} GB", inGigabytes(tot_a_s));
 }
 
 //------------------------------------------------------------------------------
@@ -385,12 +1047,13 @@ vcfbwt::VCF::init_vcf(const std::string& vcf_path, std::vector<Variation>& l_var
 void
 vcfbwt::VCF::init_vcf(const std::string &vcf_path, std::size_t i)
 {
+    init_thread_pool();
     init_vcf(vcf_path, variations, samples, samples_id, i);
     std::size_t tot_a_s = 0, tot_samples = 0;
     for (auto& s : this->samples)
     {
-        tot_a_s += s.variations.size();
-        if (s.variations.size() > 0) { tot_samples += 1; }
+        tot_a_s += s.variations_size();
+        if (s.variations_size() > 0) { tot_samples += 1; }
     }
     spdlog::info("Average variations per sample: {}", tot_a_s / tot_samples);
 }
@@ -415,16 +1078,18 @@ vcfbwt::VCF::init_multi_vcf(const std::vector<std::string>& vcfs_path)
     if (vcfs_path.empty()) { spdlog::error("No vcf file provided"); std::exit(EXIT_FAILURE); }
     
     spdlog::info("Opening {} vcf files, assuming input order reflects the intended genome order", vcfs_path.size());
+    init_thread_pool();
 
     std::vector<std::vector<Sample>> tmp_samples_array;
-    std::vector<std::vector<Variation>> tmp_variations_array;
+    std::vector<Variations> tmp_variations_array;
     std::vector<std::unordered_map<std::string, std::size_t>> tmp_samples_id;
 
     tmp_samples_array.resize(vcfs_path.size());
     tmp_variations_array.resize(vcfs_path.size());
     tmp_samples_id.resize(vcfs_path.size());
 
-    #pragma omp parallel for schedule(static)
+    // A single vcf is decoded outside of a parallel region, so that it can be split in shards
+    #pragma omp parallel for schedule(static) if(vcfs_path.size() > 1)
     for (std::size_t i = 0; i < vcfs_path.size(); i++)
     {
         init_vcf(vcfs_path[i],
@@ -439,8 +1104,7 @@ vcfbwt::VCF::init_multi_vcf(const std::vector<std::string>& vcfs_path)
     for (std::size_t i = 0; i < vcfs_path.size(); i++)
     {
         std::size_t prev_variations_arr_size = variations.size();
-        this->variations.insert(this->variations.end(), tmp_variations_array[i].begin(), tmp_variations_array[i].end());
-        tmp_variations_array[i].clear();
+        this->variations.append(tmp_variations_array[i]);
 
         for (auto& sample : tmp_samples_array[i])
         {
@@ -451,33 +1115,234 @@ vcfbwt::VCF::init_multi_vcf(const std::vector<std::string>& vcfs_path)
                 this->samples_id.insert(std::make_pair(sample.id(), this->samples.size() - 1));
             }
 
-            for (auto& sample_variation : sample.variations)
-            {
-                this->samples[samples_id[sample.id()]].variations.push_back(sample_variation + prev_variations_arr_size);
-            }
-    
-            for (auto& genotype_info : sample.genotypes)
-            {
-                this->samples[samples_id[sample.id()]].genotypes.push_back(genotype_info);
-            }
+            this->samples[samples_id[sample.id()]].append(sample, 0, prev_variations_arr_size);
         }
         tmp_samples_array[i].clear();
+        tmp_variations_array[i].clear();
         tmp_samples_id[i].clear();
     }
 
     // print some statistics
-    spdlog::info("Variations size [{}]: {}GB", variations.size(), inGigabytes(variations.size() * sizeof(Variation)));
+    spdlog::info("Variations size [{}]: {}GB", variations.size(), inGigabytes(variations.size_in_bytes()));
     spdlog::info("Reference size: {} GB", inGigabytes(reference.size()));
     
-    std::size_t tot_a_s = 0, tot_samples = 0;
+    std::size_t tot_a_s = 0, tot_bytes = 0, tot_samples = 0;
     for (auto& s : this->samples)
     {
-        tot_a_s += s.variations.size();
-        if (s.variations.size() > 0) { tot_samples += 1; }
+        tot_a_s += s.variations_size(); tot_bytes += s.size_in_bytes();
+        if (s.variations_size() > 0) { tot_samples += 1; }
     }
-    spdlog::info("Samples size: {} GB", inGigabytes(tot_a_s * 8));
+    spdlog::info("Samples size: {} GB", inGigabytes(tot_bytes));
     spdlog::info("Average variations per sample: {}", tot_a_s / tot_samples);
 }
 
 //------------------------------------------------------------------------------
 
+void
+vcfbwt::VCF::init_stream(const std::vector<std::string>& vcfs_path)
+{
+    if (vcfs_path.empty()) { spdlog::error("No vcf file provided"); std::exit(EXIT_FAILURE); }
+    
+    // The samples are the ones of the first vcf, the samples of the next vcfs are matched by id
+    spdlog::info("Streaming {} vcf files, assuming input order reflects the intended genome order", vcfs_path.size());
+    this->stream_vcfs_path = vcfs_path;
+    init_thread_pool();
+    open_vcf(this->stream, vcfs_path[0], this->variations, this->samples, this->samples_id, 0);
+}
+
+void
+vcfbwt::VCF::read_until(std::size_t position)
+{
+    if (not this->streaming) { spdlog::error("vcfbwt::VCF::read_until: the vcf is not streamed"); std::exit(EXIT_FAILURE); }
+    
+    while ((this->stream_position != std::string::npos) and (this->stream_position < position))
+    {
+        if (read_record(this->stream, this->variations, this->samples)) { this->stream_position = this->stream.variation.pos; continue; }
+        
+        // Next vcf, samples not in the first one are not added
+        close_vcf(this->stream);
+        if (++this->stream_vcf < this->stream_vcfs_path.size())
+        {
+            open_vcf(this->stream, this->stream_vcfs_path[this->stream_vcf], this->variations, this->samples, this->samples_id,
+                     this->stream_vcf, false);
+        }
+        else
+        {
+            this->stream_position = std::string::npos;
+            
+            // Samples without variations are not parsed, the last one with variations ends the sequences
+            Sample& last = this->samples.at(this->populated_samples.back());
+            auto with_variations = std::find_if(this->populated_samples.rbegin(), this->populated_samples.rend(),
+                                                [&](std::size_t i) { return this->samples[i].variations_read() != 0; });
+            if ((last.variations_read() == 0) and (with_variations != this->populated_samples.rend()))
+            { this->samples[*with_variations].set_last(last.last_variation_type); last.is_last_sample = false; }
+        }
+    }
+    spdlog::debug("Streaming: {} variations in memory", this->variations.size());
+}
+
+void
+vcfbwt::VCF::drop_until(std::size_t position)
+{
+    std::size_t dropped = this->dropped_variations;
+    while ((dropped < this->variations.size()) and (this->variations.pos(dropped) <= position))
+    {
+        if (this->variations.pos(dropped) + std::max<std::size_t>(this->variations.ref_len(dropped), 1) > position)
+        { spdlog::error("vcfbwt::VCF::drop_until: variation at {} goes past {}", this->variations.pos(dropped), position); std::exit(EXIT_FAILURE); }
+        dropped++;
+    }
+    
+    // The dropped variations are only hidden, they are removed once they are more than the ones left
+    this->dropped_variations = dropped;
+    for (auto& sample : this->samples) { sample.drop_variations_before(dropped); }
+    if (dropped > this->variations.size() - dropped)
+    {
+        this->variations.drop_front(dropped);
+        #pragma omp parallel for schedule(dynamic)
+        for (std::size_t i = 0; i < this->samples.size(); i++) { this->samples[i].compact(dropped); }
+        this->dropped_variations = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+
+uint64_t
+vcfbwt::VCF::sources_checksum(const std::vector<std::string>& refs_path, const std::vector<std::string>& vcfs_path,
+                              const std::set<std::string>& samples, std::size_t max_samples)
+{
+    // The whole content of every file, mapped and hashed in chunks in parallel. Any change to the sources is seen,
+    // copying them around is not.
+    constexpr std::size_t chunk = 1 << 26;
+    std::vector<uint64_t> fingerprint;
+    for (const std::vector<std::string>* paths : { &refs_path, &vcfs_path })
+    {
+        for (const std::string& path : *paths)
+        {
+            std::error_code error;
+            std::size_t size = std::filesystem::file_size(path, error);
+            mio::mmap_source file;
+            if (not error and (size != 0)) { file.map(path, error); }
+            if (error) { spdlog::error("Can't open file: {}", path); std::exit(EXIT_FAILURE); }
+            
+            std::vector<uint64_t> hashes(2 * ((size + chunk - 1) / chunk), 0);
+            #pragma omp parallel for schedule(dynamic, 1)
+            for (std::size_t c = 0; c < hashes.size() / 2; c++)
+            { MurmurHash3_x64_128(file.data() + (c * chunk), std::min(chunk, size - (c * chunk)), 0, hashes.data() + (2 * c)); }
+            
+            uint64_t hash[2] = { 0 };
+            MurmurHash3_x64_128(hashes.data(), hashes.size() * sizeof(uint64_t), 0, hash);
+            fingerprint.insert(fingerprint.end(), { uint64_t(paths == &vcfs_path), size, hash[0], hash[1] });
+        }
+    }
+    
+    // The selection, a different one needs its own cache
+    std::string selection;
+    for (const std::string& id : samples) { selection.append(id); selection.push_back('\n'); }
+    uint64_t hash[2] = { 0 };
+    MurmurHash3_x64_128(selection.data(), selection.size(), 0, hash);
+    fingerprint.insert(fingerprint.end(), { uint64_t(samples.size()), uint64_t(max_samples), hash[0], hash[1] });
+    
+    MurmurHash3_x64_128(fingerprint.data(), fingerprint.size() * sizeof(uint64_t), 0, hash);
+    return hash[0];
+}
+
+void
+vcfbwt::VCF::write_cache(const std::string& cache_path, uint64_t checksum) const
+{
+    // Written aside and renamed, an interrupted run never leaves a cache that looks valid
+    std::string tmp_path = cache_path + ".tmp";
+    CacheWriter writer{ std::ofstream(tmp_path, std::ios::binary) };
+    if (not writer.out.is_open()) { spdlog::error("Can't create variant cache: {}", cache_path); std::exit(EXIT_FAILURE); }
+    
+    writer.out.write(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    writer.put(CACHE_VERSION); writer.put(checksum);
+    writer.put(this->reference); writer.put(this->ref_sum_lengths);
+    
+    const Variations& v = this->variations;
+    writer.put(v.positions); writer.put(v.ref_lengths); writer.put(v.frequencies);
+    writer.put(v.first_allele); writer.put(v.allele_offsets); writer.put(v.alleles_pool);
+    
+    // Sample major, the genotypes of a sample are contiguous
+    writer.put(uint64_t(this->samples.size()));
+    for (const Sample& sample : this->samples)
+    {
+        writer.put(sample.sample_id);
+        writer.put(sample.number_of_variations); writer.put(sample.last_id); writer.put(sample.allele_bits);
+        writer.put(sample.variation_deltas); writer.put(sample.checkpoint_ids); writer.put(sample.checkpoint_offsets);
+        writer.put(uint64_t(sample.allele_columns.size()));
+        for (const auto& column : sample.allele_columns) { writer.put(column); }
+    }
+    
+    writer.out.close();
+    std::error_code error;
+    if (not writer.out.fail()) { std::filesystem::rename(tmp_path, cache_path, error); }
+    if (writer.out.fail() or error) { spdlog::error("Error writing variant cache: {}", cache_path); std::exit(EXIT_FAILURE); }
+    spdlog::info("Variant cache written: {}", cache_path);
+}
+
+bool
+vcfbwt::VCF::read_cache(const std::string& cache_path, uint64_t checksum)
+{
+    if (not std::filesystem::exists(cache_path)) { return false; }
+    
+    std::error_code error;
+    mio::mmap_source cache; cache.map(cache_path, error);
+    if (error or (cache.size() < sizeof(CACHE_MAGIC)) or (std::memcmp(cache.data(), CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0))
+    { spdlog::error("Not a variant cache: {}", cache_path); std::exit(EXIT_FAILURE); }
+    
+    CacheReader reader{ cache.data() + sizeof(CACHE_MAGIC), cache.data() + cache.size(), cache_path };
+    if ((reader.get() != CACHE_VERSION) or (reader.get() != checksum))
+    { spdlog::warn("Variant cache {} is stale, the vcfs, the references or the samples selected changed", cache_path); return false; }
+    
+    spdlog::info("Reading variant cache: {}", cache_path);
+    reader.get(this->reference); reader.get(this->ref_sum_lengths);
+    
+    Variations& v = this->variations;
+    reader.get(v.positions); reader.get(v.ref_lengths); reader.get(v.frequencies);
+    reader.get(v.first_allele); reader.get(v.allele_offsets); reader.get(v.alleles_pool);
+    
+    // The samples not wanted have no variations in the cache, only the wanted ones are copied out
+    std::size_t n_samples = reader.get();
+    if (this->max_samples == 0) { set_max_samples(n_samples); }
+    for (std::size_t i = 0; i < n_samples; i++)
+    {
+        std::string id; reader.get(id);
+        bool wanted = (i < this->max_samples) and (input_samples.empty() or input_samples.contains(id));
+        
+        Sample sample(id, this->reference, this->variations);
+        sample.number_of_variations = reader.get(); sample.last_id = reader.get(); sample.allele_bits = reader.get();
+        if (not wanted)
+        {
+            reader.view<uint8_t>(); reader.view<std::size_t>(); reader.view<std::size_t>();
+            for (std::size_t g = reader.get(); g > 0; g--) { reader.view<uint64_t>(); }
+            continue;
+        }
+        
+        reader.get(sample.variation_deltas); reader.get(sample.checkpoint_ids); reader.get(sample.checkpoint_offsets);
+        sample.allele_columns.resize(reader.get());
+        for (auto& column : sample.allele_columns) { reader.get(column); }
+        sample.read_variations = sample.number_of_variations;
+        
+        this->samples_id.insert(std::make_pair(id, this->samples.size()));
+        this->samples.push_back(std::move(sample));
+    }
+    
+    spdlog::info("Variations size [{}]: {}GB", this->variations.size(), inGigabytes(this->variations.size_in_bytes()));
+    spdlog::info("{} samples out of {} read from the cache", this->samples.size(), n_samples);
+    return true;
+}
+
+void
+vcfbwt::VCF::init_cache(const std::vector<std::string>& refs_path, const std::vector<std::string>& vcfs_path,
+                        const std::string& cache_path)
+{
+    uint64_t checksum = sources_checksum(refs_path, vcfs_path, this->input_samples, this->max_samples);
+    if (read_cache(cache_path, checksum)) { return; }
+    
+    // Built from the vcfs decoded as without a cache, so the samples and the variations are the same
+    spdlog::info("Building variant cache: {}", cache_path);
+    init_multi_ref(refs_path); init_multi_vcf(vcfs_path);
+    write_cache(cache_path, checksum);
+}
+
+//------------------------------------------------------------------------------
@@ -424,6 +424,60 @@ TEST_CASE( "Reproducing bug", "[KR Window]" )
     REQUIRE(kr_window_2.get_hash() % 30 == 0);
 }
 
+TEST_CASE( "Window hash same as KarpRabinHash", "[KR Window]" )
+{
+    std::string test_string = "ACGTNNNNNNNNacgtTTTTGGGGCCCCAAAA\5\5\5\4\2ACGGGTACCCATTTAGAGAGAGGGGGACTAACCG";
+    
+    std::size_t n = 10;
+    vcfbwt::KarpRabinHash kr_window(n);
+    vcfbwt::KarpRabinWindow<10> kr_window_10;
+    vcfbwt::KarpRabinWindow<> kr_window_runtime(n);
+    kr_window.initialize(test_string.substr(0, n));
+    kr_window_10.initialize(test_string.substr(0, n));
+    kr_window_runtime.initialize(test_string.substr(0, n));
+    
+    bool all_equal = true;
+    for (std::size_t i = 0; i + n < test_string.size(); i++)
+    {
+        kr_window.update(test_string[i], test_string[i + n]);
+        kr_window_10.update(test_string[i], test_string[i + n]);
+        kr_window_runtime.update(test_string[i], test_string[i + n]);
+        all_equal = all_equal and (kr_window.get_hash() == kr_window_10.get_hash());
+        all_equal = all_equal and (kr_window.get_hash() == kr_window_runtime.get_hash());
+        
+        // Re-initializing on the current window gives back the same hash
+        vcfbwt::KarpRabinWindow<10> kr_window_check;
+        kr_window_check.initialize(&(test_string[i + 1]));
+        all_equal = all_equal and (kr_window_check.get_hash() == kr_window_10.get_hash());
+    }
+    
+    REQUIRE(all_equal);
+}
+
+TEST_CASE( "Block trigger strings", "[KR Window]" )
+{
+    std::string test_string;
+    for (std::size_t i = 0; i < 100000; i++) { test_string.push_back("ACGTN"[(i * i + (i / 7)) % 5]); }
+    
+    for (std::size_t w : { 5, 10, 20 })
+    {
+        vcfbwt::KarpRabinHash kr_window(w);
+        kr_window.initialize(test_string.substr(0, w));
+        std::vector<std::size_t> expected;
+        if ((kr_window.get_hash() % 75) == 0) { expected.push_back(w - 1); }
+        for (std::size_t i = w; i < test_string.size(); i++)
+        {
+            kr_window.update(test_string[i - w], test_string[i]);
+            if ((kr_window.get_hash() % 75) == 0) { expected.push_back(i); }
+        }
+        
+        std::vector<std::size_t> triggers;
+        vcfbwt::find_trigger_strings(test_string.data(), test_string.size(), w, 75, triggers);
+        
+        REQUIRE(triggers == expected);
+    }
+}
+
 //------------------------------------------------------------------------------
 
 TEST_CASE( "Dictionary size", "[Dictionary]")
@@ -445,6 +499,104 @@ TEST_CASE( "Dictionary size", "[Dictionary]")
     REQUIRE(dictionary.size() == elem);
 }
 
+TEST_CASE( "Dictionary concurrent insertions", "[Dictionary]")
+{
+    vcfbwt::pfp::Dictionary dictionary;
+
+    // Every thread inserts the same elements
+    std::size_t tot_elem = 100000, wrong_hashes = 0;
+    #pragma omp parallel for schedule(static) num_threads(8) reduction(+:wrong_hashes)
+    for (std::size_t t = 0; t < 8; t++)
+    {
+        for (std::size_t elem = 0; elem < tot_elem; elem++)
+        {
+            std::string phrase = std::to_string((elem + (t * 12345)) % tot_elem);
+            if (dictionary.check_and_add(phrase) != dictionary.get(phrase)) { wrong_hashes++; }
+        }
+    }
+    REQUIRE(wrong_hashes == 0);
+
+    bool all_elements_in_dict = true;
+    for (std::size_t elem = 0; elem < tot_elem; elem++)
+    {
+        all_elements_in_dict = all_elements_in_dict and dictionary.contains(std::to_string(elem));
+    }
+    REQUIRE(all_elements_in_dict);
+    REQUIRE(dictionary.size() == tot_elem);
+
+    // Sorted entries
+    for (std::size_t i = 1; i < dictionary.size(); i++)
+    {
+        REQUIRE(dictionary.sorted_entry_at(i - 1) < dictionary.sorted_entry_at(i));
+    }
+}
+
+TEST_CASE( "Dictionary phrase ids", "[Dictionary]")
+{
+    vcfbwt::pfp::Dictionary dictionary;
+    std::vector<std::string> phrases = { "GATTACA", "ACGT", "TTTT", "AAAA", "CCGG" };
+
+    // Ids are dense and in insertion order
+    for (std::size_t i = 0; i < phrases.size(); i++) { REQUIRE(dictionary.check_and_add_id(phrases[i]) == i); }
+    REQUIRE(dictionary.check_and_add_id("ACGT") == 1);
+
+    // Ranks are a permutation of the ids
+    for (std::size_t i = 0; i < phrases.size(); i++)
+    {
+        vcfbwt::size_type rank = dictionary.id_to_rank(i);
+        REQUIRE(dictionary.sorted_entry_at(rank - 1) == phrases[i]);
+        REQUIRE(rank == dictionary.hash_to_rank(dictionary.get(phrases[i])));
+    }
+}
+
+TEST_CASE( "Parallel string sort", "[Dictionary]")
+{
+    // Long shared prefixes, sentinels and prefixes of other strings
+    std::mt19937 generator(7);
+    std::uniform_int_distribution<int> length(0, 40), chars(0, 5);
+    const char alphabet[6] = { vcfbwt::pfp::DOLLAR, vcfbwt::pfp::DOLLAR_PRIME, 'A', 'C', 'G', '\xF0' };
+
+    std::vector<std::string> strings;
+    std::string prefix(50, 'N');
+    for (std::size_t i = 0; i < 100000; i++)
+    {
+        std::string s = prefix.substr(0, length(generator));
+        std::size_t suffix_length = length(generator);
+        for (std::size_t j = 0; j < suffix_length; j++) { s.push_back(alphabet[chars(generator)]); }
+        strings.push_back(s);
+    }
+
+    std::vector<std::pair<std::string_view, vcfbwt::hash_type>> to_sort;
+    for (std::size_t i = 0; i < strings.size(); i++) { to_sort.emplace_back(strings[i], i); }
+    vcfbwt::sort_strings(to_sort);
+
+    std::vector<std::string> expected = strings;
+    std::sort(expected.begin(), expected.end());
+    bool sorted = true;
+    for (std::size_t i = 0; i < expected.size(); i++) { sorted = sorted and (to_sort[i].first == expected[i]); }
+    REQUIRE(sorted);
+}
+
+//------------------------------------------------------------------------------
+
+TEST_CASE( "Writes across several buffers", "[AsyncWriter]")
+{
+    std::string file_name = vcfbwt::TempFile::getName("writer");
+
+    // Single chars and writes larger than a buffer
+    std::string expected;
+    vcfbwt::AsyncWriter writer(file_name);
+    for (std::size_t i = 0; i < 3 * vcfbwt::AsyncWriter::buffer_size + 17; i++) { writer.put(char(i % 251)); expected.push_back(char(i % 251)); }
+    std::string large(2 * vcfbwt::AsyncWriter::buffer_size + 5, 'A');
+    writer.write(large.data(), large.size()); expected.append(large);
+    REQUIRE(writer.tellp() == expected.size());
+    writer.close();
+
+    std::ifstream in(file_name, std::ios::binary);
+    std::string written((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    REQUIRE(written == expected);
+}
+
 //------------------------------------------------------------------------------
 
 TEST_CASE( "Constructor with samples specified", "[VCF parser]" )
@@ -532,6 +684,250 @@ TEST_CASE("Sample: HG00101", "[VCF parser]")
     REQUIRE(((i == (from_vcf.size())) and (i == (from_fasta.size()))));
 }
 
+TEST_CASE( "Sample iterator from a reference position", "[VCF parser]" )
+{
+    std::string reference;
+    for (std::size_t i = 0; i < 1000; i++) { reference.push_back("ACGT"[(i * i + (i / 3)) % 4]); }
+
+    // SNP, insertion, deletion and a variation not in the genotype
+    std::vector<vcfbwt::Variation> records(4);
+    records[0].pos = 100; records[0].ref_len = 1; records[0].alt = { reference.substr(100, 1), "T" };
+    records[1].pos = 300; records[1].ref_len = 1; records[1].alt = { reference.substr(300, 1), reference.substr(300, 1) + "GGGG" };
+    records[2].pos = 500; records[2].ref_len = 6; records[2].alt = { reference.substr(500, 6), reference.substr(500, 1) };
+    records[3].pos = 700; records[3].ref_len = 1; records[3].alt = { reference.substr(700, 1), "A" };
+    vcfbwt::Variations variations;
+    for (const auto& record : records) { variations.push_back(record); }
+
+    vcfbwt::Sample sample("S", reference, variations);
+    std::vector<std::vector<int>> genotypes = { { 1, 0 }, { 1, 0 }, { 1, 0 }, { 0, 1 } };
+    for (std::size_t i = 0; i < variations.size(); i++) { sample.add_variation(i, genotypes[i]); }
+
+    std::string full;
+    std::vector<std::size_t> positions;
+    for (vcfbwt::Sample::iterator it(sample, 0); not it.end(); ++it) { full.push_back(*it); positions.push_back(it.get_ref_it()); }
+
+    for (std::size_t position : { 50, 200, 400, 600, 800 })
+    {
+        std::string from_position;
+        for (vcfbwt::Sample::iterator it(sample, 0, position); not it.end(); ++it) { from_position.push_back(*it); }
+
+        std::size_t start = std::find(positions.begin(), positions.end(), position) - positions.begin();
+        REQUIRE(from_position == full.substr(start));
+    }
+
+    // go_to skips the reference stretches, and the variations once indexed, it ends where stepping one char at a time does
+    for (bool indexed : { false, true })
+    {
+        if (indexed) { sample.build_index(); }
+        for (std::size_t position : { 50, 301, 503, 650, 990 })
+        {
+            vcfbwt::Sample::iterator jumped(sample, 0), stepped(sample, 0);
+            jumped.go_to(position);
+            while (stepped.get_ref_it() + 1 < position) { ++stepped; }
+            REQUIRE(jumped.get_sam_it() == stepped.get_sam_it());
+
+            std::string from_jumped, from_stepped;
+            for (; not jumped.end(); ++jumped) { from_jumped.push_back(*jumped); }
+            for (; not stepped.end(); ++stepped) { from_stepped.push_back(*stepped); }
+            REQUIRE(from_jumped == from_stepped);
+        }
+        REQUIRE(vcfbwt::Sample::iterator(sample, 0).length() == full.size());
+    }
+
+    // Spans
+    std::string from_spans;
+    for (vcfbwt::Sample::iterator it(sample, 0); not it.end(); )
+    { std::string_view span = it.span(); from_spans.append(span); it.advance(span.size()); }
+    REQUIRE(from_spans == full);
+}
+
+TEST_CASE( "Sample packed variations", "[VCF parser]" )
+{
+    std::string reference(100000, 'A');
+    vcfbwt::Variations variations;
+    for (std::size_t i = 0; i < 20000; i++)
+    {
+        vcfbwt::Variation variation; variation.pos = i * 5; variation.ref_len = 1;
+        variation.alt = { "A", "C", "G", "T", "CC", "GG", "TT" }; variations.push_back(variation);
+    }
+
+    // Sparse ids with large gaps, alleles getting wider and a genotype appearing later on
+    vcfbwt::Sample sample("S", reference, variations);
+    std::vector<std::size_t> ids; std::vector<std::vector<int>> alleles;
+    for (std::size_t id = 3; id < variations.size(); id += 1 + (id * 7) % 300)
+    {
+        std::vector<int> genotype = { int(id % 2), int(id % 7) };
+        if (ids.size() > 100) { genotype.push_back(int(id % 3)); }
+        if (ids.size() < 50) { genotype[1] = int(id % 2); }
+        sample.add_variation(id, genotype);
+        ids.push_back(id); alleles.push_back(genotype);
+    }
+
+    REQUIRE(sample.variations_size() == ids.size());
+    REQUIRE(sample.ploidy() == 3);
+    for (std::size_t i = 0; i < ids.size(); i++)
+    {
+        REQUIRE(sample.variation_id(i) == ids[i]);
+        for (std::size_t g = 0; g < 3; g++) { REQUIRE(sample.allele(i, g) == ((g < alleles[i].size()) ? alleles[i][g] : 0)); }
+    }
+
+    std::size_t visited = 0;
+    sample.for_each_variation([&](std::size_t i, std::size_t id)
+    { REQUIRE(id == ids[i]); REQUIRE(variations.pos(id) == ids[i] * 5); visited++; });
+    REQUIRE(visited == ids.size());
+}
+
+TEST_CASE( "Sample appended without decoding", "[VCF parser]" )
+{
+    std::string reference(100000, 'A');
+    vcfbwt::Variations variations;
+
+    // A tail with wide alleles and a third genotype, appended from different ids after heads of different lengths
+    std::vector<std::size_t> tail_ids; std::vector<std::vector<int>> tail_alleles;
+    for (std::size_t id = 2; id < 5000; id += 1 + (id * 7) % 40)
+    {
+        tail_ids.push_back(id);
+        tail_alleles.push_back({ int(id % 2), int(id % 7), int(id % 3) });
+    }
+    for (std::size_t narrow = 0; narrow < 2; narrow++)
+    {
+        vcfbwt::Sample tail("T", reference, variations);
+        for (std::size_t i = 0; i < tail_ids.size(); i++)
+        {
+            std::vector<int> genotype = tail_alleles[i];
+            if (narrow) { genotype = { genotype[0] }; }
+            tail.add_variation(tail_ids[i], genotype);
+        }
+        
+        for (std::size_t head_size : { 0, 1, 63, 64, 100 })
+        {
+            for (std::size_t from_id : { std::size_t(0), tail_ids[1], tail_ids[64], tail_ids[200], tail_ids.back() + 1 })
+            {
+                vcfbwt::Sample sample("S", reference, variations), expected("S", reference, variations);
+                for (std::size_t i = 0; i < head_size; i++)
+                {
+                    std::vector<int> genotype = { int(i % 2), int((i + 1) % 3) };
+                    sample.add_variation(i * 3, genotype); expected.add_variation(i * 3, genotype);
+                }
+                std::size_t base = head_size * 3 + 10;
+                for (std::size_t i = 0; i < tail_ids.size(); i++)
+                {
+                    if (tail_ids[i] < from_id) { continue; }
+                    std::vector<int> genotype = tail_alleles[i];
+                    if (narrow) { genotype = { genotype[0] }; }
+                    expected.add_variation(base + tail_ids[i] - from_id, genotype);
+                }
+                
+                sample.append(tail, from_id, base);
+                REQUIRE(sample.variations_size() == expected.variations_size());
+                REQUIRE(sample.variations_read() == expected.variations_read());
+                REQUIRE(sample.ploidy() == expected.ploidy());
+                for (std::size_t i = 0; i < expected.variations_size(); i++)
+                {
+                    REQUIRE(sample.variation_id(i) == expected.variation_id(i));
+                    for (std::size_t g = 0; g < expected.ploidy(); g++) { REQUIRE(sample.allele(i, g) == expected.allele(i, g)); }
+                }
+                std::vector<std::size_t> ids, expected_ids;
+                sample.for_each_variation([&](std::size_t i, std::size_t id) { ids.push_back(id); });
+                expected.for_each_variation([&](std::size_t i, std::size_t id) { expected_ids.push_back(id); });
+                REQUIRE(ids == expected_ids);
+                
+                // Variations added after it go on from the last appended id
+                std::vector<int> genotype = { 1, 1 };
+                sample.add_variation(base + 6000, genotype); expected.add_variation(base + 6000, genotype);
+                REQUIRE(sample.variation_id(sample.variations_size() - 1) == base + 6000);
+            }
+        }
+    }
+}
+
+TEST_CASE( "Sample variations dropped and compacted", "[VCF parser]" )
+{
+    std::string reference; std::uint64_t state = 11;
+    for (std::size_t i = 0; i < 20000; i++) { state = state * 6364136223846793005ULL + 1442695040888963407ULL; reference.push_back("ACGT"[state >> 62]); }
+
+    vcfbwt::Variations variations, compacted;
+    std::vector<vcfbwt::Variation> records;
+    for (std::size_t pos = 100; pos + 100 < reference.size(); pos += 37)
+    {
+        vcfbwt::Variation variation; variation.pos = pos; variation.ref_len = 1 + (pos % 3);
+        variation.alt = { reference.substr(pos, variation.ref_len), "A", reference.substr(pos, 1) + "GG" };
+        records.push_back(variation); variations.push_back(variation);
+    }
+
+    std::size_t dropped = records.size() / 3, position = records[dropped].pos;
+    for (std::size_t v = dropped; v < records.size(); v++) { compacted.push_back(records[v]); }
+
+    // The same genotypes, dropped in place or with only the variations left
+    vcfbwt::Sample sample("S", reference, variations), expected("S", reference, compacted);
+    std::size_t added = 0;
+    for (std::size_t v = 0; v < records.size(); v++)
+    {
+        if (v % 4 == 0) { continue; }
+        std::vector<int> genotype = { int(v % 3), int((v + 1) % 3) };
+        sample.add_variation(v, genotype); added++;
+        if (v >= dropped) { expected.add_variation(v - dropped, genotype); }
+    }
+
+    auto from_position = [&](const vcfbwt::Sample& s, std::size_t genotype)
+    {
+        std::string chars;
+        for (vcfbwt::Sample::iterator it(s, genotype, position); not it.end(); ++it) { chars.push_back(*it); }
+        return chars;
+    };
+    std::vector<std::size_t> expected_ids;
+    expected.for_each_variation([&](std::size_t i, std::size_t id) { expected_ids.push_back(id); });
+
+    sample.drop_variations_before(dropped);
+    REQUIRE(sample.variations_size() == expected.variations_size());
+    REQUIRE(sample.variations_read() == added);
+    std::vector<std::size_t> ids;
+    sample.for_each_variation([&](std::size_t i, std::size_t id)
+    { ids.push_back(id - dropped); REQUIRE(sample.allele(i, 1) == int((id + 1) % 3)); });
+    REQUIRE(ids == expected_ids);
+    for (std::size_t genotype = 0; genotype < 2; genotype++) { REQUIRE(from_position(sample, genotype) == from_position(expected, genotype)); }
+
+    variations.drop_front(dropped); sample.compact(dropped);
+    REQUIRE(sample.variations_size() == expected.variations_size());
+    REQUIRE(sample.variations_read() == added);
+    for (std::size_t i = 0; i < expected.variations_size(); i++) { REQUIRE(sample.variation_id(i) == expected.variation_id(i)); }
+    for (std::size_t genotype = 0; genotype < 2; genotype++) { REQUIRE(from_position(sample, genotype) == from_position(expected, genotype)); }
+}
+
+TEST_CASE( "Variations with pooled alleles", "[VCF parser]" )
+{
+    vcfbwt::Variations first, second;
+    vcfbwt::Variation variation;
+    variation.pos = 10; variation.ref_len = 3; variation.freq = 0.5; variation.alt = { "ACG", "A", "ACGTT" };
+    first.push_back(variation);
+    variation.pos = 20; variation.ref_len = 1; variation.freq = 0.25; variation.alt = { "T", "" };
+    first.push_back(variation);
+    variation.pos = 5; variation.ref_len = 1; variation.freq = 1.0; variation.alt = { "G", "C" };
+    second.push_back(variation);
+
+    first.append(second);
+    REQUIRE(first.size() == 3);
+    REQUIRE(first.alleles(0) == 3); REQUIRE(first.alleles(1) == 2); REQUIRE(first.alleles(2) == 2);
+    REQUIRE(first.allele(0, 0) == "ACG"); REQUIRE(first.allele(0, 2) == "ACGTT");
+    REQUIRE(first.allele(1, 0) == "T"); REQUIRE(first.allele(1, 1).empty());
+    REQUIRE(first.allele(2, 1) == "C");
+    REQUIRE(first.pos(2) == 5); REQUIRE(first.ref_len(0) == 3); REQUIRE(first.freq(1) == 0.25);
+
+    // Only the variations from an id on
+    vcfbwt::Variations tail;
+    tail.append(first, 1);
+    REQUIRE(tail.size() == 2);
+    REQUIRE(tail.alleles(0) == 2); REQUIRE(tail.allele(0, 0) == "T"); REQUIRE(tail.allele(0, 1).empty());
+    REQUIRE(tail.allele(1, 1) == "C"); REQUIRE(tail.pos(1) == 5); REQUIRE(tail.freq(0) == 0.25);
+    tail.append(first, 3);
+    REQUIRE(tail.size() == 2);
+
+    first.clear();
+    REQUIRE(first.empty());
+    first.push_back(variation);
+    REQUIRE(first.allele(0, 0) == "G");
+}
+
 TEST_CASE( "Sample: HG00103", "[VCF parser]" )
 {
     std::string vcf_file_name = testfiles_dir + "/ALL.chrY.phase3_integrated_v2a.20130502.genotypes.vcf.gz";
@@ -587,6 +983,239 @@ TEST_CASE( "Selecting only Sample: HG00103", "[VCF parser]" )
     REQUIRE(((i == (from_vcf.size())) and (i == (from_fasta.size()))));
 }
 
+// A reference of 200 chars and a vcf of samples A, B and C. B has a symbolic allele at 20, the samples after it don't
+// get that record unless B is left out.
+void write_small_vcf(const std::string& ref_file_name, const std::string& vcf_file_name, const std::string& a_genotype = "0|1")
+{
+    std::string reference;
+    for (std::size_t i = 0; i < 200; i++) { reference.push_back("ACGT"[i % 4]); }
+    { zstr::ofstream ref_file(ref_file_name); ref_file << ">1\n" << reference << "\n"; }
+
+    std::ofstream vcf_file(vcf_file_name);
+    vcf_file << "##fileformat=VCFv4.2\n##contig=<ID=1,length=200>\n";
+    vcf_file << "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n";
+    vcf_file << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tA\tB\tC\n";
+    vcf_file << "1\t20\t.\tT\tG,<DEL>\t.\tPASS\t.\tGT\t" << a_genotype << "\t0|2\t0|1\n";
+    vcf_file << "1\t50\t.\tC\tA\t.\tPASS\t.\tGT\t1|0\t1|0\t1|0\n";
+}
+
+TEST_CASE( "Samples selected in the vcf header", "[VCF parser]" )
+{
+    std::string ref_file_name = vcfbwt::TempFile::getName("ref") + ".fa.gz";
+    std::string vcf_file_name = vcfbwt::TempFile::getName("subset") + ".vcf";
+    std::string samples_file_name = vcfbwt::TempFile::getName("samples");
+    write_small_vcf(ref_file_name, vcf_file_name);
+    { std::ofstream samples_file(samples_file_name); samples_file << "A\nC\n"; }
+
+    int threads = omp_get_max_threads();
+    for (int t : { 1, 4 })
+    {
+        omp_set_num_threads(t);
+        vcfbwt::VCF all(ref_file_name, vcf_file_name, "");
+        REQUIRE(all.size() == 3);
+        REQUIRE(all[0].variations_size() == 2);
+        REQUIRE(all[1].variations_size() == 1);
+        REQUIRE(all[2].id() == "C"); REQUIRE(all[2].variations_size() == 1);
+
+        vcfbwt::VCF first_two(ref_file_name, vcf_file_name, "", 2);
+        REQUIRE(first_two.size() == 2);
+        REQUIRE(first_two[0].variations_size() == 2); REQUIRE(first_two[1].variations_size() == 1);
+
+        vcfbwt::VCF selected(ref_file_name, vcf_file_name, samples_file_name);
+        REQUIRE(selected.size() == 2);
+        REQUIRE(selected[0].id() == "A"); REQUIRE(selected[0].variations_size() == 2);
+        REQUIRE(selected[1].id() == "C"); REQUIRE(selected[1].variations_size() == 2);
+        REQUIRE(selected[1].get_variations().pos(selected[1].variation_id(0)) == 19);
+    }
+    omp_set_num_threads(threads);
+
+    std::remove(ref_file_name.c_str()); std::remove(vcf_file_name.c_str()); std::remove(samples_file_name.c_str());
+}
+
+TEST_CASE( "Indexed vcf decoded in shards", "[VCF parser]" )
+{
+    std::vector<std::string> vcfs_file_names = { testfiles_dir + "/ALL.chrY.phase3_integrated_v2a.20130502.genotypes.vcf.gz" };
+    std::vector<std::string> refs_file_names = { testfiles_dir + "/Y.fa.gz" };
+
+    // One thread reads the records in order, more split the vcf in shards using its index
+    int threads = omp_get_max_threads();
+    omp_set_num_threads(1);
+    vcfbwt::VCF sequential(refs_file_names, vcfs_file_names, "");
+    omp_set_num_threads(4);
+    vcfbwt::VCF sharded(refs_file_names, vcfs_file_names, "");
+    omp_set_num_threads(threads);
+
+    const vcfbwt::Variations& expected = sequential.get_variations();
+    const vcfbwt::Variations& variations = sharded.get_variations();
+    REQUIRE(variations.size() == expected.size());
+    for (std::size_t v = 0; v < expected.size(); v++)
+    {
+        REQUIRE(variations.pos(v) == expected.pos(v));
+        REQUIRE(variations.ref_len(v) == expected.ref_len(v));
+        REQUIRE(variations.freq(v) == expected.freq(v));
+        REQUIRE(variations.alleles(v) == expected.alleles(v));
+        for (std::size_t a = 0; a < expected.alleles(v); a++) { REQUIRE(variations.allele(v, a) == expected.allele(v, a)); }
+    }
+
+    REQUIRE(sharded.size() == sequential.size());
+    for (std::size_t i = 0; i < sequential.size(); i++)
+    {
+        REQUIRE(sharded[i].id() == sequential[i].id());
+        REQUIRE(sharded[i].variations_size() == sequential[i].variations_size());
+        REQUIRE(sharded[i].ploidy() == sequential[i].ploidy());
+        std::vector<std::size_t> ids, expected_ids;
+        sequential[i].for_each_variation([&](std::size_t v, std::size_t id) { expected_ids.push_back(id); });
+        sharded[i].for_each_variation([&](std::size_t v, std::size_t id)
+        {
+            ids.push_back(id);
+            for (std::size_t g = 0; g < sequential[i].ploidy(); g++) { REQUIRE(sharded[i].allele(v, g) == sequential[i].allele(v, g)); }
+        });
+        REQUIRE(ids == expected_ids);
+    }
+}
+
+TEST_CASE( "Variant cache", "[VCF parser]" )
+{
+    std::vector<std::string> vcfs_file_names = { testfiles_dir + "/ALL.chrY.phase3_integrated_v2a.20130502.genotypes.vcf.gz" };
+    std::vector<std::string> refs_file_names = { testfiles_dir + "/Y.fa.gz" };
+    std::string samples_file_name = testfiles_dir + "/allowed_samples_list.txt";
+    std::string cache_file_name = vcfbwt::TempFile::getName("pfpvar");
+
+    vcfbwt::VCF from_vcf(refs_file_names, vcfs_file_names, samples_file_name);
+
+    // Built on the first use, then read back with the same sample selection
+    for (std::size_t run = 0; run < 2; run++)
+    {
+        vcfbwt::VCF from_cache(refs_file_names, vcfs_file_names, samples_file_name, 0, 0, false, cache_file_name);
+        REQUIRE(from_cache.get_reference() == from_vcf.get_reference());
+        REQUIRE(from_cache.size() == from_vcf.size());
+        REQUIRE(from_cache[0].id() == "HG00103");
+
+        std::string expected, cached;
+        for (vcfbwt::Sample::iterator it(from_vcf[0]); not it.end(); ++it) { expected.push_back(*it); }
+        for (vcfbwt::Sample::iterator it(from_cache[0]); not it.end(); ++it) { cached.push_back(*it); }
+        REQUIRE(cached == expected);
+    }
+
+    std::remove(cache_file_name.c_str());
+}
+
+TEST_CASE( "Variant cache of changed sources", "[VCF parser]" )
+{
+    std::string ref_file_name = vcfbwt::TempFile::getName("ref") + ".fa.gz";
+    std::string vcf_file_name = vcfbwt::TempFile::getName("cached") + ".vcf";
+    std::string cache_file_name = vcfbwt::TempFile::getName("pfpvar");
+    write_small_vcf(ref_file_name, vcf_file_name);
+
+    // Written on the first use, then read
+    for (std::size_t run = 0; run < 2; run++)
+    {
+        vcfbwt::VCF vcf({ ref_file_name }, { vcf_file_name }, "", 0, 0, false, cache_file_name);
+        REQUIRE(vcf.size() == 3);
+        REQUIRE(vcf[0].id() == "A"); REQUIRE(vcf[0].allele(0, 1) == 1);
+    }
+    std::string cache;
+    { std::ifstream cache_file(cache_file_name, std::ios::binary); cache.assign(std::istreambuf_iterator<char>(cache_file), {}); }
+
+    // Same size and modification time, a genotype changed in the middle
+    auto modified = std::filesystem::last_write_time(vcf_file_name);
+    write_small_vcf(ref_file_name, vcf_file_name, "1|1");
+    std::filesystem::last_write_time(vcf_file_name, modified);
+
+    vcfbwt::VCF vcf({ ref_file_name }, { vcf_file_name }, "", 0, 0, false, cache_file_name);
+    REQUIRE(vcf[0].allele(0, 0) == 1); REQUIRE(vcf[0].allele(0, 1) == 1);
+    std::string rebuilt;
+    { std::ifstream cache_file(cache_file_name, std::ios::binary); rebuilt.assign(std::istreambuf_iterator<char>(cache_file), {}); }
+    REQUIRE(rebuilt.size() == cache.size());
+    REQUIRE(rebuilt != cache);
+
+    std::remove(ref_file_name.c_str()); std::remove(vcf_file_name.c_str()); std::remove(cache_file_name.c_str());
+}
+
+TEST_CASE( "Variant cache of a sample selection", "[VCF parser]" )
+{
+    std::string ref_file_name = vcfbwt::TempFile::getName("ref") + ".fa.gz";
+    std::string vcf_file_name = vcfbwt::TempFile::getName("selected") + ".vcf";
+    std::string samples_file_name = vcfbwt::TempFile::getName("samples");
+    std::string cache_file_name = vcfbwt::TempFile::getName("pfpvar");
+    write_small_vcf(ref_file_name, vcf_file_name);
+    { std::ofstream samples_file(samples_file_name); samples_file << "A\nC\n"; }
+
+    // B is left out and has a symbolic allele on the first record, with all the samples C doesn't get it. The cache
+    // of all the samples is then rebuilt for the selection, and read back.
+    vcfbwt::VCF uncached({ ref_file_name }, { vcf_file_name }, samples_file_name);
+    for (const std::string& selection : { std::string(""), samples_file_name, samples_file_name })
+    {
+        vcfbwt::VCF cached({ ref_file_name }, { vcf_file_name }, selection, 0, 0, false, cache_file_name);
+        if (selection.empty()) { REQUIRE(cached.size() == 3); REQUIRE(cached[2].variations_size() == 1); continue; }
+
+        const vcfbwt::Variations& expected = uncached.get_variations();
+        const vcfbwt::Variations& variations = cached.get_variations();
+        REQUIRE(variations.size() == expected.size());
+        for (std::size_t v = 0; v < expected.size(); v++)
+        {
+            REQUIRE(variations.pos(v) == expected.pos(v));
+            REQUIRE(variations.freq(v) == expected.freq(v));
+            REQUIRE(variations.alleles(v) == expected.alleles(v));
+        }
+
+        REQUIRE(cached.size() == uncached.size());
+        for (std::size_t i = 0; i < uncached.size(); i++)
+        {
+            REQUIRE(cached[i].id() == uncached[i].id());
+            REQUIRE(cached[i].variations_size() == uncached[i].variations_size());
+            for (std::size_t v = 0; v < uncached[i].variations_size(); v++)
+            {
+                REQUIRE(cached[i].variation_id(v) == uncached[i].variation_id(v));
+                for (std::size_t g = 0; g < 2; g++) { REQUIRE(cached[i].allele(v, g) == uncached[i].allele(v, g)); }
+            }
+        }
+        REQUIRE(cached[1].id() == "C"); REQUIRE(cached[1].variations_size() == 2);
+    }
+
+    std::remove(ref_file_name.c_str()); std::remove(vcf_file_name.c_str());
+    std::remove(samples_file_name.c_str()); std::remove(cache_file_name.c_str());
+}
+
+TEST_CASE( "Reference parsed in parallel blocks", "[PFP algorithm]" )
+{
+    std::string reference;
+    for (std::size_t i = 0; i < 3 * vcfbwt::pfp::PARSING_BLOCK_SIZE + 1234; i++) { reference.push_back("ACGT"[(i * i + (i / 13)) % 4]); }
+
+    vcfbwt::pfp::Params params; params.w = 10; params.p = 75;
+    omp_set_num_threads(4);
+    vcfbwt::pfp::ReferenceParse reference_parse(reference, params);
+
+    // Sequential parse
+    std::vector<std::string> expected; std::vector<std::size_t> expected_positions;
+    std::string phrase(1, vcfbwt::pfp::DOLLAR);
+    vcfbwt::KarpRabinHash kr_window(params.w);
+    for (std::size_t i = 0; i < reference.size(); i++)
+    {
+        phrase.push_back(reference[i]);
+        if (i < params.w - 1) { continue; }
+        if (i == params.w - 1) { kr_window.initialize(reference.substr(0, params.w)); }
+        else { kr_window.update(reference[i - params.w], reference[i]); }
+        if ((kr_window.get_hash() % params.p) == 0)
+        {
+            expected.push_back(phrase); expected_positions.push_back(i + 1 - params.w);
+            phrase.erase(phrase.begin(), phrase.end() - params.w);
+        }
+    }
+    phrase.append(params.w - 1, vcfbwt::pfp::DOLLAR_PRIME); phrase.append(1, vcfbwt::pfp::DOLLAR_SEQUENCE);
+    expected.push_back(phrase); expected_positions.push_back(reference.size() - 1);
+
+    REQUIRE(reference_parse.parse.size() == expected.size());
+    REQUIRE(reference_parse.trigger_strings_position == std::vector<vcfbwt::size_type>(expected_positions.begin(), expected_positions.end()));
+    bool same_phrases = true;
+    for (std::size_t i = 0; i < expected.size(); i++)
+    {
+        vcfbwt::size_type rank = reference_parse.dictionary.id_to_rank(reference_parse.parse[i]);
+        same_phrases = same_phrases and (reference_parse.dictionary.sorted_entry_at(rank - 1) == expected[i]);
+    }
+    REQUIRE(same_phrases);
+}
+
 TEST_CASE( "Reference + Sample HG00096, No acceleration", "[PFP algorithm]" )
 {
     std::string vcf_file_name = testfiles_dir + "/ALL.chrY.phase3_integrated_v2a.20130502.genotypes.vcf.gz";
@@ -693,6 +1322,150 @@ TEST_CASE( "Reference + Sample HG00096, WITH acceleration", "[PFP algorithm]" )
     REQUIRE(check);
 }
 
+TEST_CASE( "Variant bubbles reused across samples", "[PFP algorithm]" )
+{
+    std::string reference; std::uint64_t state = 42;
+    for (std::size_t i = 0; i < 60000; i++) { state = state * 6364136223846793005ULL + 1442695040888963407ULL; reference.push_back("ACGT"[state >> 62]); }
+
+    // A SNP every 1500 chars and an insertion every 4000
+    vcfbwt::Variations variations;
+    for (std::size_t pos = 700; pos + 1000 < reference.size(); pos += 1500)
+    {
+        vcfbwt::Variation variation; variation.pos = pos; variation.ref_len = 1; variation.used = true;
+        variation.alt.push_back(reference.substr(pos, 1));
+        variation.alt.push_back((reference[pos] == 'A') ? "C" : "A");
+        if (pos % 4000 < 1500) { variation.alt.push_back(reference.substr(pos, 1) + "GATTACA"); }
+        variations.push_back(variation);
+    }
+
+    // The first two samples are the same, the third one differs on every other variation
+    std::vector<vcfbwt::Sample> samples;
+    for (std::size_t s = 0; s < 3; s++)
+    {
+        samples.emplace_back("S" + std::to_string(s), reference, variations);
+        for (std::size_t v = 0; v < variations.size(); v++)
+        {
+            int allele = ((s == 2) and (v % 2 == 0)) ? 1 : int(variations.alleles(v) - 1);
+            samples.back().add_variation(v, { allele, 0 });
+        }
+    }
+    samples.back().set_last(0);
+
+    vcfbwt::pfp::Params params;
+    params.w = w_global; params.p = p_global;
+    params.use_acceleration = true;
+    vcfbwt::pfp::ReferenceParse reference_parse(reference, params);
+
+    std::string out_prefix = testfiles_dir + "/bubbles_out";
+    vcfbwt::pfp::ParserVCF main_parser(params, out_prefix, reference_parse);
+    vcfbwt::pfp::ParserVCF worker;
+    worker.init(params, out_prefix, reference_parse, vcfbwt::pfp::ParserVCF::WORKER | vcfbwt::pfp::ParserVCF::UNCOMPRESSED);
+    main_parser.register_worker(worker);
+    for (const auto& sample : samples) { worker(sample); }
+    main_parser.close();
+
+    std::string what_it_should_be(1, vcfbwt::pfp::DOLLAR);
+    what_it_should_be.append(reference);
+    for (auto& sample : samples)
+    {
+        what_it_should_be.append(params.w - 1, vcfbwt::pfp::DOLLAR_PRIME);
+        what_it_should_be.append(1, vcfbwt::pfp::DOLLAR_SEQUENCE);
+        vcfbwt::Sample::iterator it(sample, 0);
+        while (not it.end()) { what_it_should_be.push_back(*it); ++it; }
+    }
+    what_it_should_be.append(params.w - 1, vcfbwt::pfp::DOLLAR_PRIME);
+    what_it_should_be.append(params.w, vcfbwt::pfp::DOLLAR);
+
+    REQUIRE(main_parser.get_statistics().bubble_cache_hits > 0);
+    REQUIRE(unparse_and_check(out_prefix, what_it_should_be, params.w, vcfbwt::pfp::DOLLAR));
+}
+
+TEST_CASE( "Samples parsed by regions", "[PFP algorithm]" )
+{
+    std::string reference; std::uint64_t state = 7;
+    for (std::size_t i = 0; i < 60000; i++) { state = state * 6364136223846793005ULL + 1442695040888963407ULL; reference.push_back("ACGT"[state >> 62]); }
+
+    // SNPs, insertions and deletions, some close to each other
+    vcfbwt::Variations variations;
+    for (std::size_t pos = 500; pos + 1000 < reference.size(); pos += (pos % 7 == 0) ? 15 : 700)
+    {
+        vcfbwt::Variation variation; variation.pos = pos; variation.used = true;
+        if (pos % 5 == 0) { variation.ref_len = 4; variation.alt = { reference.substr(pos, 4), reference.substr(pos, 1) }; }
+        else { variation.ref_len = 1; variation.alt = { reference.substr(pos, 1), (reference[pos] == 'A') ? "C" : "A", reference.substr(pos, 1) + "TT" }; }
+        variations.push_back(variation);
+    }
+
+    // S2 has variations only in the second half, S3 has none
+    std::vector<vcfbwt::Sample> samples;
+    for (std::size_t s = 0; s < 5; s++)
+    {
+        samples.emplace_back("S" + std::to_string(s), reference, variations);
+        for (std::size_t v = ((s == 2) ? variations.size() / 2 : 0); (s != 3) and (v < variations.size()); v++)
+        { if ((v + s) % 3 != 0) { samples.back().add_variation(v, { int(1 + (v + s) % (variations.alleles(v) - 1)), 0 }); } }
+    }
+    samples.back().set_last(0);
+
+    vcfbwt::pfp::Params params;
+    params.w = w_global; params.p = p_global;
+    vcfbwt::pfp::ReferenceParse reference_parse(reference, params);
+
+    // Regions of all the samples one after the other, spread on two workers
+    std::string out_prefix = testfiles_dir + "/regions_out";
+    vcfbwt::pfp::ParserVCF main_parser(params, out_prefix, reference_parse);
+    std::vector<vcfbwt::pfp::ParserVCF> workers(2);
+    for (auto& worker : workers)
+    {
+        worker.init(params, out_prefix, reference_parse, vcfbwt::pfp::ParserVCF::WORKER | vcfbwt::pfp::ParserVCF::UNCOMPRESSED);
+        main_parser.register_worker(worker);
+    }
+
+    // A sample is the reference before its first variation, it is parsed from its start in the region with it
+    std::size_t from = std::string::npos, regions = 0;
+    std::vector<bool> started(samples.size(), false);
+    do
+    {
+        std::size_t to = main_parser.region_end(variations, ((from == std::string::npos) ? 0 : from) + 5000, std::string::npos);
+        for (std::size_t s = 0; s < samples.size(); s++)
+        {
+            if (samples[s].variations_size() == 0) { continue; }
+            if ((not started[s]) and (to != std::string::npos) and (variations.pos(samples[s].variation_id(0)) >= to)) { continue; }
+            workers[(s + regions) % 2](samples[s], s, regions, started[s] ? from : std::string::npos, to); started[s] = true;
+        }
+        from = to; regions++;
+    } while (from != std::string::npos);
+    main_parser.close();
+    REQUIRE(regions > 5);
+
+    // Same parse as the whole samples
+    {
+        vcfbwt::pfp::ReferenceParse whole_reference_parse(reference, params);
+        vcfbwt::pfp::ParserVCF whole_parser(params, out_prefix + "_whole", whole_reference_parse);
+        vcfbwt::pfp::ParserVCF worker;
+        worker.init(params, out_prefix, whole_reference_parse, vcfbwt::pfp::ParserVCF::WORKER | vcfbwt::pfp::ParserVCF::UNCOMPRESSED);
+        whole_parser.register_worker(worker);
+        for (std::size_t s = 0; s < samples.size(); s++) { if (samples[s].variations_size() != 0) { worker(samples[s], s); } }
+        whole_parser.close();
+    }
+    std::ifstream regions_parse(out_prefix + vcfbwt::EXT::PARSE), whole_parse(out_prefix + "_whole" + vcfbwt::EXT::PARSE);
+    REQUIRE(std::string((std::istreambuf_iterator<char>(regions_parse)), std::istreambuf_iterator<char>()) ==
+            std::string((std::istreambuf_iterator<char>(whole_parse)), std::istreambuf_iterator<char>()));
+
+    std::string what_it_should_be(1, vcfbwt::pfp::DOLLAR);
+    what_it_should_be.append(reference);
+    for (auto& sample : samples)
+    {
+        if (sample.variations_size() == 0) { continue; }
+        what_it_should_be.append(params.w - 1, vcfbwt::pfp::DOLLAR_PRIME);
+        what_it_should_be.append(1, vcfbwt::pfp::DOLLAR_SEQUENCE);
+        vcfbwt::Sample::iterator it(sample, 0);
+        while (not it.end()) { what_it_should_be.push_back(*it); ++it; }
+    }
+    what_it_should_be.append(params.w - 1, vcfbwt::pfp::DOLLAR_PRIME);
+    what_it_should_be.append(params.w, vcfbwt::pfp::DOLLAR);
+
+    REQUIRE(unparse_and_check(out_prefix, what_it_should_be, params.w, vcfbwt::pfp::DOLLAR));
+}
+
 TEST_CASE( "Sample: HG00096, twice chromosome Y", "[VCF parser]" )
 {
     std::vector<std::string> vcf_file_names =
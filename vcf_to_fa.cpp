@@ -59,11 +59,10 @@ int main(int argc, char **argv)
     for (std::size_t i = 0; i < vcf.size(); i++)
     {
         vcfbwt::Sample::iterator it(vcf[i]);
-        std::string sample;
-    
-        while (not it.end()) { sample.push_back(*it); ++it; }
         samples << "> " + vcf[i].id() + "\n";
-        samples.write(sample.c_str(), sample.size());
+    
+        // One write per reference slice or allele
+        while (not it.end()) { std::string_view span = it.span(); samples.write(span.data(), span.size()); it.advance(span.size()); }
         samples.put('\n');
     }
     samples.close();